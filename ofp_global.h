@@ -4,4 +4,5 @@
 int64_t cached_generation_id;
 bool generation_is_defined;
 struct  openflow_switch ofp_switch;
+struct  ofp_reactor ofp_reactor;
 #endif
@@ -1,9 +1,15 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #include "ofp_global.h"
 #include "openflow_conn.h"
 #include "openflow_enum.h"
@@ -12,23 +18,412 @@
 #include "openflow_util.h"
 #include "openflow_messages.h"
 
-uint8_t 
-send_openflow_message (struct ofp_conn *connection, uint16_t length,
-                      uint8_t type, uint32_t xid, void *buf)
+/* Message buffers are recycled through per-thread free lists, one per
+ * power of two size class, instead of going back to malloc/free for
+ * every encoded message. */
+static __thread struct ofp_buf_pool ofp_buf_pool;
+
+static inline uint32_t
+ofp_buf_size_class (uint32_t size)
+{
+   if (size <= OFP_BUF_MIN_SIZE)
+      return 0;
+   return 32 - __builtin_clz (size - 1) - OFP_BUF_MIN_SHIFT;
+}
+
+/* Borrow a buffer of at least 'size' bytes. It goes back to the pool
+ * with ofp_buf_free, which the output queue does once the message is
+ * written to the socket. */
+void *
+ofp_buf_alloc (uint32_t size)
+{
+   struct ofp_buf_pool *pool = &ofp_buf_pool;
+   struct ofp_buf_hdr *hdr;
+   uint32_t size_class = ofp_buf_size_class (size);
+
+   if (size_class >= OFP_BUF_N_CLASSES) {
+      /* Bigger than any class, not pooled */
+      hdr = malloc (sizeof(struct ofp_buf_hdr) + size);
+      if (!hdr)
+         return NULL;
+   }
+   else if (pool->free_list[size_class]) {
+      hdr = pool->free_list[size_class];
+      pool->free_list[size_class] = hdr->next;
+      pool->n_free[size_class]--;
+   }
+   else {
+      hdr = malloc (sizeof(struct ofp_buf_hdr) + 
+                    (OFP_BUF_MIN_SIZE << size_class));
+      if (!hdr)
+         return NULL;
+   }
+   hdr->size_class = size_class;
+   hdr->refcount = 1;
+   return hdr + 1;
+}
+
+/* One more holder of a buffer, e.g. the output queue of one more
+ * controller for a message encoded once. Each holder calls ofp_buf_free. */
+void
+ofp_buf_ref (void *buf)
+{
+   ((struct ofp_buf_hdr *) buf - 1)->refcount++;
+}
+
+void
+ofp_buf_free (void *buf)
+{
+   struct ofp_buf_pool *pool = &ofp_buf_pool;
+   struct ofp_buf_hdr *hdr;
+   uint32_t size_class;
+
+   if (!buf)
+      return;
+   hdr = (struct ofp_buf_hdr *) buf - 1;
+   if (--hdr->refcount)
+      return;
+   size_class = hdr->size_class;
+   if (size_class >= OFP_BUF_N_CLASSES ||
+       pool->n_free[size_class] >= (OFP_BUF_POOL_MAX_BYTES >> 
+                                    (OFP_BUF_MIN_SHIFT + size_class))) {
+      free (hdr);
+      return;
+   }
+   hdr->next = pool->free_list[size_class];
+   pool->free_list[size_class] = hdr;
+   pool->n_free[size_class]++;
+}
+
+/* Free the buffers of the first 'n' pending entries of the queue */
+static void
+ofp_out_queue_release (struct ofp_out_queue *queue, uint16_t n)
+{
+   while (n--) {
+      ofp_buf_free (queue->bufs[queue->head]);
+      queue->head++;
+      queue->count--;
+   }
+   if (queue->count == 0)
+      queue->head = 0;
+}
+
+/* Drop everything still queued, e.g. when the connection is closed */
+void
+ofp_out_queue_purge (struct ofp_out_queue *queue)
+{
+   ofp_out_queue_release (queue, queue->count);
+   queue->pending_bytes = 0;
+}
+
+/* Write as much of the output queue as the socket accepts with one
+ * writev() per pass. A partially written message stays at the head
+ * of the queue. Returns non-zero on a socket error. */
+uint8_t
+ofp_conn_flush (struct ofp_conn *connection)
+{
+   struct ofp_out_queue *queue = &connection->out_queue;
+   struct iovec *iov;
+   ssize_t n;
+
+   while (queue->count) {
+      n = writev (connection->sock_fd, &queue->iov[queue->head], queue->count);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* The reactor resumes the flush on EPOLLOUT */
+            connection->write_blocked = TRUE;
+            return 0;
+         }
+         printf("ERROR writing to socket\n");
+         return 1;
+      }
+      queue->pending_bytes -= n;
+      /* release the messages which are sent completely */
+      while (n > 0) {
+         iov = &queue->iov[queue->head];
+         if ((size_t) n < iov->iov_len) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+            break;
+         }
+         n -= iov->iov_len;
+         ofp_out_queue_release (queue, 1);
+      }
+   }
+   return 0;
+}
+
+/* Messages sent between ofp_conn_batch_begin and ofp_conn_batch_end
+ * are coalesced and written together at the end of the batch (end of
+ * a dispatch cycle) or when OFP_OUT_QUEUE_FLUSH_BYTES are pending. */
+void
+ofp_conn_batch_begin (struct ofp_conn *connection)
+{
+   connection->batching = TRUE;
+}
+
+uint8_t
+ofp_conn_batch_end (struct ofp_conn *connection)
+{
+   connection->batching = FALSE;
+   return ofp_conn_flush (connection);
+}
+
+/* Make room for 'n' more entries at the tail of the output queue,
+ * pushing out what is pending and compacting if needed */
+static bool
+ofp_out_queue_reserve (struct ofp_conn *connection, uint16_t n)
+{
+  struct ofp_out_queue *queue = &connection->out_queue;
+
+  if (queue->head + queue->count + n > OFP_OUT_QUEUE_LEN) {
+    ofp_conn_flush (connection);
+    if (queue->head + queue->count + n > OFP_OUT_QUEUE_LEN && queue->head) {
+      memmove (&queue->iov[0], &queue->iov[queue->head],
+               queue->count * sizeof(struct iovec));
+      memmove (&queue->bufs[0], &queue->bufs[queue->head],
+               queue->count * sizeof(void *));
+      queue->head = 0;
+    }
+  }
+  return queue->head + queue->count + n <= OFP_OUT_QUEUE_LEN;
+}
+
+static void
+ofp_out_queue_push (struct ofp_out_queue *queue, void *base, size_t len, void *owner)
+{
+  uint16_t tail = queue->head + queue->count;
+
+  queue->iov[tail].iov_base = base;
+  queue->iov[tail].iov_len = len;
+  queue->bufs[tail] = owner;
+  queue->count++;
+  queue->pending_bytes += len;
+}
+
+/* Send the queue via the socket unless the connection is batching */
+static uint8_t
+ofp_conn_kick (struct ofp_conn *connection)
+{
+  if (connection->write_blocked)
+    return 0;
+  if (!connection->batching ||
+      connection->out_queue.pending_bytes >= OFP_OUT_QUEUE_FLUSH_BYTES)
+    return ofp_conn_flush (connection);
+  return 0;
+}
+
+/* Queue the connection for service in the current cycle */
+static void
+ofp_reactor_activate (struct ofp_reactor *reactor, struct ofp_conn *connection)
+{
+   if (!connection->active) {
+      connection->active = TRUE;
+      reactor->active[reactor->n_active++] = connection;
+   }
+}
+
+/* Copy the borrowed bytes still queued into buffers of the queue, for
+ * callers whose bytes do not outlive the call */
+static uint8_t
+ofp_out_queue_own (struct ofp_conn *connection)
 {
-  /* Encode the OpenFlow header first */
-  int n=0;
-  struct ofp_header *header = NULL;
-  header = (struct ofp_header *) buf; 
+  struct ofp_out_queue *queue = &connection->out_queue;
+  uint16_t i;
+  void *copy;
+
+  for (i = queue->head; i < queue->head + queue->count; i++) {
+    if (queue->bufs[i])
+      continue;
+    copy = ofp_buf_alloc (queue->iov[i].iov_len);
+    if (!copy) {
+      /* The stream cannot go on without these bytes */
+      printf("ERROR out of memory for a queued message\n");
+      connection->closing = TRUE;
+      ofp_reactor_activate (&ofp_reactor, connection);
+      return 1;
+    }
+    memcpy (copy, queue->iov[i].iov_base, queue->iov[i].iov_len);
+    queue->iov[i].iov_base = copy;
+    queue->bufs[i] = copy;
+  }
+  return 0;
+}
+
+static void
+ofp_header_encode (void *buf, uint8_t type, uint16_t length, uint32_t xid)
+{
+  struct ofp_header *header = (struct ofp_header *) buf;
+
   header->version = OFP14_VERSION;
   header->type = type;
-  header->length = htons(length); 
+  header->length = htons(length + sizeof(struct ofp_header)); 
   header->xid = htonl(xid); 
-  /* send the buffer via the socket */ 
-  n = write(connection->sock_fd,buf,length+sizeof(struct ofp_header));
-  if (n < 0) 
-    printf("ERROR writing to socket\n");
-  return 0;
+}
+
+/* Queue an encoded message, handing the output queue our reference */
+static uint8_t
+ofp_conn_queue (struct ofp_conn *connection, void *buf, uint16_t total_len)
+{
+  if (!ofp_out_queue_reserve (connection, 1)) {
+    ofp_buf_free (buf);
+    return 1;
+  }
+  ofp_out_queue_push (&connection->out_queue, buf, total_len, buf);
+  return ofp_conn_kick (connection);
+}
+
+/* Encode the OpenFlow header and queue the message on the connection.
+ * The buffer is owned by the output queue from here on and is freed
+ * once its bytes are written to the socket. */
+uint8_t 
+send_openflow_message (struct ofp_conn *connection, uint16_t length,
+                      uint8_t type, uint32_t xid, void *buf)
+{
+  ofp_header_encode (buf, type, length, xid);
+  return ofp_conn_queue (connection, buf, length + sizeof(struct ofp_header));
+}
+
+/* Same as send_openflow_message, but the last 'data_len' bytes of the
+ * message are written straight from 'data' instead of being copied
+ * behind 'buf'. 'data' only has to stay valid during the call: what is
+ * not written by then is copied. Data past the biggest message length
+ * ofp_header.length can carry is left out. */
+uint8_t
+send_openflow_message_sg (struct ofp_conn *connection, uint16_t length,
+                          uint8_t type, uint32_t xid, void *buf,
+                          const void *data, uint16_t data_len)
+{
+  uint8_t ret;
+
+  if ((uint32_t) sizeof(struct ofp_header) + length + data_len > OFP_MAX_MSG_LEN)
+    data_len = OFP_MAX_MSG_LEN - sizeof(struct ofp_header) - length;
+  if (!data_len)
+    return send_openflow_message (connection, length, type, xid, buf);
+  ofp_header_encode (buf, type, length + data_len, xid);
+  if (!ofp_out_queue_reserve (connection, 2)) {
+    ofp_buf_free (buf);
+    return 1;
+  }
+  ofp_out_queue_push (&connection->out_queue, buf, length + sizeof(struct ofp_header), buf);
+  ofp_out_queue_push (&connection->out_queue, (void *) data, data_len, NULL);
+  ret = connection->write_blocked ? 0 : ofp_conn_flush (connection);
+  if (connection->out_queue.count && ofp_out_queue_own (connection))
+    return 1;
+  return ret;
+}
+
+/* Reasons each connection gets until it sets its own async config:
+ * everything for masters and equals, port status and being demoted by
+ * a new master for slaves */
+static const uint32_t ofp_async_default_mask[OFPACPT_REQUESTFORWARD_MASTER + 1] = {
+   [OFPACPT_PACKET_IN_MASTER] = (1 << (OFPR_PACKET_OUT + 1)) - 1,
+   [OFPACPT_PORT_STATUS_SLAVE] = (1 << (OFPPR_MODIFY + 1)) - 1,
+   [OFPACPT_PORT_STATUS_MASTER] = (1 << (OFPPR_MODIFY + 1)) - 1,
+   [OFPACPT_ROLE_STATUS_SLAVE] = 1 << OFPCRR_MASTER_REQUEST,
+   [OFPACPT_FLOW_REMOVED_MASTER] = (1 << (OFPRR_EVICTION + 1)) - 1,
+   [OFPACPT_ROLE_STATUS_MASTER] = (1 << (OFPCRR_EXPERIMENTER + 1)) - 1,
+   [OFPACPT_TABLE_STATUS_MASTER] = (1 << OFPTR_VACANCY_DOWN) | (1 << OFPTR_VACANCY_UP),
+   [OFPACPT_REQUESTFORWARD_MASTER] = (1 << 2) - 1,
+};
+
+/* Work out the reasons a connection wants with its current role and
+ * async config, and set its bit in the subscriber maps accordingly.
+ * Called when the connection comes up and on role or config changes,
+ * never when a message is sent. */
+void
+ofp_ctrl_registry_update (struct ofp_conn *connection)
+{
+   struct ofp_ctrl_registry *registry = &ofp_reactor.registry;
+   uint64_t bit;
+   uint32_t event, reason;
+   bool slave = (connection->role == OFPCR_ROLE_SLAVE);
+
+   for (event=0;event<OFP_ASYNC_N_EVENTS;event++)
+      connection->async_wanted[event] =
+         connection->async_config_mask[2 * event + (slave ? 0 : 1)];
+   if (connection->ctrl_slot >= OFP_CTRL_MAX)
+      return;
+   bit = 1ULL << connection->ctrl_slot;
+   for (event=0;event<OFP_ASYNC_N_EVENTS;event++) {
+      for (reason=0;reason<OFP_ASYNC_MAX_REASONS;reason++) {
+         if (connection->async_wanted[event] & (1u << reason))
+            registry->subscribers[event][reason] |= bit;
+         else
+            registry->subscribers[event][reason] &= ~bit;
+      }
+   }
+}
+
+/* Register a new connection with the default async config */
+static void
+ofp_ctrl_registry_add (struct ofp_conn *connection)
+{
+   struct ofp_ctrl_registry *registry = &ofp_reactor.registry;
+
+   memcpy (connection->async_config_mask, ofp_async_default_mask,
+           sizeof(ofp_async_default_mask));
+   if (registry->used == ~0ULL) {
+      printf("ERROR too many controllers, no asynchronous messages for this one\n");
+      connection->ctrl_slot = OFP_CTRL_MAX;
+   }
+   else {
+      connection->ctrl_slot = __builtin_ctzll (~registry->used);
+      registry->used |= 1ULL << connection->ctrl_slot;
+      registry->slots[connection->ctrl_slot] = connection;
+   }
+   ofp_ctrl_registry_update (connection);
+}
+
+static void
+ofp_ctrl_registry_del (struct ofp_conn *connection)
+{
+   struct ofp_ctrl_registry *registry = &ofp_reactor.registry;
+   uint64_t bit;
+   uint32_t event, reason;
+
+   if (connection->ctrl_slot >= OFP_CTRL_MAX)
+      return;
+   bit = 1ULL << connection->ctrl_slot;
+   for (event=0;event<OFP_ASYNC_N_EVENTS;event++) {
+      for (reason=0;reason<OFP_ASYNC_MAX_REASONS;reason++)
+         registry->subscribers[event][reason] &= ~bit;
+   }
+   registry->used &= ~bit;
+   registry->slots[connection->ctrl_slot] = NULL;
+   connection->ctrl_slot = OFP_CTRL_MAX;
+}
+
+/* Connections which get an asynchronous message. Callers check it
+ * before encoding, nothing is encoded for nobody. */
+static inline uint64_t
+ofp_async_subscribers (enum ofp_async_event event, uint8_t reason)
+{
+   return reason < OFP_ASYNC_MAX_REASONS ?
+          ofp_reactor.registry.subscribers[event][reason] : 0;
+}
+
+/* Queue a message encoded once on every connection of 'subscribers'.
+ * The connections share the buffer, which goes back to the pool once
+ * the last of them wrote it. */
+static void
+ofp_async_publish (uint64_t subscribers, uint8_t type, void *buf, uint16_t length)
+{
+   struct ofp_conn *connection;
+   uint32_t slot;
+
+   ofp_header_encode (buf, type, length, 0);
+   for (; subscribers; subscribers &= subscribers - 1) {
+      slot = __builtin_ctzll (subscribers);
+      connection = ofp_reactor.registry.slots[slot];
+      if (!connection || connection->closing)
+         continue;
+      ofp_buf_ref (buf);
+      ofp_conn_queue (connection, buf, length + sizeof(struct ofp_header));
+   }
+   ofp_buf_free (buf);
 }
 
 uint8_t 
@@ -37,8 +432,10 @@ send_error_message(struct ofp_conn *connection, uint32_t xid,
 {
    struct ofp_error_msg *error_msg = NULL;
    uint8_t ret;
-   char *buf = malloc (sizeof(struct ofp_error_msg));
+   char *buf = ofp_buf_alloc (sizeof(struct ofp_error_msg));
 
+   if (!buf)
+      return 1;
    error_msg = (struct ofp_error_msg *) buf; 
    memset(error_msg,0,sizeof(struct ofp_error_msg));
    error_msg->type = htons(error_type);
@@ -46,76 +443,77 @@ send_error_message(struct ofp_conn *connection, uint32_t xid,
    ret = send_openflow_message (connection, 
                                (sizeof(struct ofp_error_msg) - sizeof (struct ofp_header)), 
                                OFPT_ERROR, xid, buf);
-   free (buf);
    return ret;
 }
 
-uint8_t
-process_role_request_message (struct ofp_conn *connection, char *buf)
+/* Pre-encoded features, get-config and hello replies */
+static struct ofp_reply_cache ofp_reply_cache;
+
+/* Called whenever ofp_switch.features or ofp_switch.config_flag change,
+ * so that the cached replies get rebuilt on the next request */
+void
+ofp_switch_config_changed (void)
 {
-   struct ofp_role_request *role_request;
-   struct ofp_role_request *role_reply;
-   uint8_t ret;
+   ofp_switch.reply_gen++;
+}
 
-   role_request = (struct ofp_role_request *) buf;
+static void
+ofp_reply_cache_build (struct ofp_reply_cache *cache)
+{
+   struct ofp_switch_features *features_reply = &cache->features_reply;
+   struct ofp_switch_config *config_reply = &cache->config_reply;
+   struct ofp_hello *hello_msg = (struct ofp_hello *) cache->hello;
+   struct ofp_hello_elem_versionbitmap *version_bitmap;
 
-   /* Validate the generation_id. Here the generation_is_defined i
-    * and cached_generation_id are global variables */
-   if (generation_is_defined && (int64_t) 
-       (role_request->generation_id - cached_generation_id) < 0) {
+   memset(features_reply,0,sizeof(struct ofp_switch_features));
+   features_reply->datapath_id = htonl_64(ofp_switch.features.datapath_id);
+   features_reply->n_buffers = htonl(ofp_switch.features.n_buffers);
+   features_reply->n_tables = ofp_switch.features.n_tables;
+   features_reply->capabilities = htonl (ofp_switch.features.capabilities);
+   features_reply->auxiliary_id = 0; /* Assuming main connection */
 
-     /* If it is a stale message then send error message */
-     send_error_message(connection, role_request->header.xid, OFPET_ROLE_REQUEST_FAILED, OFPRRFC_STALE);
-   }
-   else {
-      if (role_request->role != OFPCR_ROLE_NOCHANGE) {
-         char *ret_buf = malloc (sizeof(struct ofp_role_request));
-         cached_generation_id = role_request->generation_id;
-         generation_is_defined = TRUE;
+   memset(config_reply,0,sizeof(struct ofp_switch_config));
+   config_reply->flags = htons(ofp_switch.config_flag);
+   /* miss_send_len is per connection and patched at send time */
 
-         /* set the role of the connection */
-         connection->role = role_request->role;
+   memset(hello_msg,0,OFP_HELLO_LEN);
+   version_bitmap = (struct ofp_hello_elem_versionbitmap *) hello_msg->elements;
+   version_bitmap->type = htons(OFPHET_VERSIONBITMAP);
+   version_bitmap->length = htons(sizeof(struct ofp_hello_elem_versionbitmap) +
+                                  sizeof(uint32_t));
+   /* Assuming that this switch supports only OF1.4 spec */
+   version_bitmap->bitmaps[0] = htonl(1 << OFP14_VERSION);
 
-         /* form the reply message and send it to controller*/
-         role_reply = (struct ofp_role_request *) ret_buf;
-         memset(role_reply,0,sizeof(struct ofp_role_request));
+   cache->gen = ofp_switch.reply_gen;
+   cache->valid = TRUE;
+}
 
-         role_reply->role = htonl(role_request->role);
-         role_reply->generation_id = htonl_64(cached_generation_id);
-         
-         ret = send_openflow_message (connection, 
-                                     (sizeof(struct ofp_role_request) - sizeof (struct ofp_header)), 
-                                      OFPT_ROLE_REPLY, role_request->header.xid, ret_buf);
-         free (ret_buf);
-      }
-   }
-   return 0;
+static inline struct ofp_reply_cache *
+ofp_reply_cache_get (void)
+{
+   if (!ofp_reply_cache.valid || ofp_reply_cache.gen != ofp_switch.reply_gen)
+      ofp_reply_cache_build (&ofp_reply_cache);
+   return &ofp_reply_cache;
 }
 
 uint8_t
 process_features_request_message (struct ofp_conn *connection, char *buf) 
 {
    struct ofp_switch_features *features_request;
-   struct ofp_switch_features *features_reply;
    uint8_t ret;
-   char *ret_buf = malloc (sizeof(struct ofp_switch_features));
+   char *ret_buf = ofp_buf_alloc (sizeof(struct ofp_switch_features));
 
+   if (!ret_buf)
+      return 1;
    features_request = (struct ofp_switch_features *) buf;
 
-   features_reply = (struct ofp_switch_features *) ret_buf;
-   memset(features_reply,0,sizeof(struct ofp_switch_features));
-
-   features_reply->datapath_id = htonl_64(ofp_switch.features.datapath_id);
-   features_reply->n_buffers = htonl(ofp_switch.features.n_buffers);
-   features_reply->n_tables = ofp_switch.features.n_tables;
-   features_reply->capabilities = htonl (ofp_switch.features.capabilities);
-   features_reply->auxiliary_id = 0; /* Assuming main connection */
+   memcpy(ret_buf, &ofp_reply_cache_get ()->features_reply,
+          sizeof(struct ofp_switch_features));
 
    ret = send_openflow_message (connection, 
                                (sizeof(struct ofp_switch_features) - sizeof (struct ofp_header)), 
-                               OFPT_FEATURES_REPLY, features_request->header.xid, ret_buf);
+                               OFPT_FEATURES_REPLY, ntohl (features_request->header.xid), ret_buf);
    /* The send_openflow_message function adds the OF header */
-   free (ret_buf);
    return ret; 
 }
 
@@ -128,40 +526,52 @@ process_get_config_message (struct ofp_conn *connection, char *buf)
    uint8_t ret;
    get_config_request = (struct ofp_header *) buf;
 
-   ret_buf = malloc (sizeof(struct ofp_switch_config));
+   ret_buf = ofp_buf_alloc (sizeof(struct ofp_switch_config));
+   if (!ret_buf)
+      return 1;
    config_reply = (struct ofp_switch_config *) ret_buf;
-   memset(config_reply ,0,sizeof(struct ofp_switch_config));
-   config_reply->flags = htons(ofp_switch.config_flag);
-   config_reply->miss_send_len = 128; /* default value */
+   memcpy(config_reply, &ofp_reply_cache_get ()->config_reply,
+          sizeof(struct ofp_switch_config));
+   config_reply->miss_send_len = htons(connection->miss_send_len);
    ret = send_openflow_message (connection, 
                                (sizeof(struct ofp_switch_config) - sizeof (struct ofp_header)), 
-                               OFPT_GET_CONFIG_REPLY, get_config_request->xid, ret_buf);
-   free (ret_buf);
+                               OFPT_GET_CONFIG_REPLY, ntohl (get_config_request->xid), ret_buf);
    return ret; 
   /* The send_openflow_message function adds the OF header */
 }
 
+uint8_t 
+process_set_config_message (struct ofp_conn *connection, char *buf) 
+{
+   struct ofp_switch_config *set_config = (struct ofp_switch_config *) buf;
+   uint16_t flags = ntohs(set_config->flags);
+
+   if (flags & ~OFPC_FRAG_MASK) {
+      send_error_message(connection, ntohl (set_config->header.xid), OFPET_SWITCH_CONFIG_FAILED, OFPSCFC_BAD_FLAGS);
+      return 0;
+   }
+   connection->miss_send_len = ntohs(set_config->miss_send_len);
+   if (ofp_switch.config_flag != flags) {
+      ofp_switch.config_flag = flags;
+      ofp_switch_config_changed ();
+   }
+   return 0;
+}
+
 uint8_t
 send_hello_message (struct ofp_conn *connection)
 {
-   /* Form a echo Reply message and send it back via the same connection */
    char *buf = NULL;
-   struct ofp_hello *hello_msg;
    uint8_t ret;
    uint32_t xid = htonl(0);
 
-   buf = malloc (sizeof(struct ofp_hello));
-   hello_msg = (struct ofp_hello *) buf;
-   memset(hello_msg,0,sizeof(struct ofp_hello));
-   
-   hello_msg->elements[0].type = htons(OFPHET_VERSIONBITMAP);
-   hello_msg->elements[0].length = sizeof(struct ofp_hello_elem_versionbitmap);
-   /* Assuming that this switch supports only OF1.4 spec */
-   //hello_msg->elements[0].bitmaps[0]= htonl(0x00000020);
-   ret = send_openflow_message (connection,(sizeof(struct ofp_hello) - sizeof (struct ofp_header)) ,
+   buf = ofp_buf_alloc (OFP_HELLO_LEN);
+   if (!buf)
+      return 1;
+   memcpy(buf, ofp_reply_cache_get ()->hello, OFP_HELLO_LEN);
+   ret = send_openflow_message (connection,(OFP_HELLO_LEN - sizeof (struct ofp_header)) ,
                                OFPT_HELLO, xid, buf);
 
-   free (buf);
    return ret;
 }
 
@@ -175,15 +585,17 @@ process_echo_request(struct ofp_conn *connection, char *buf)
    uint8_t ret;
    echo_request = (struct ofp_header *) buf;
 
-   ret_buf = malloc (sizeof(struct ofp_header));
-   echo_reply = (struct ofp_header *)buf;
+   ret_buf = ofp_buf_alloc (sizeof(struct ofp_header));
+   if (!ret_buf)
+      return 1;
+   echo_reply = (struct ofp_header *)ret_buf;
 
    memset(echo_reply,0,sizeof(struct ofp_header));
    
+   /* The request buffer belongs to the caller, only the reply is queued */
    ret = send_openflow_message (connection, 
-                               0, OFPT_ECHO_REPLY, echo_request->xid, buf);
+                               0, OFPT_ECHO_REPLY, ntohl (echo_request->xid), ret_buf);
 
-   free (buf);
    return ret;
 }
 
@@ -195,99 +607,491 @@ send_echo_request(struct ofp_conn *connection)
    ofp_echo_request *echo_request;
    uint8_t ret;
 
-   buf = malloc (sizeof(struct ofp_header));
+   buf = ofp_buf_alloc (sizeof(struct ofp_header));
+   if (!buf)
+      return 1;
    echo_request = (struct ofp_header *)  buf; 
    memset(echo_request,0,sizeof(struct ofp_header));
    
    ret = send_openflow_message (connection, 
                                0, OFPT_ECHO_REQUEST, echo_request->xid, buf);
 
-   free (buf);
    return ret;
 }
+uint8_t
+process_barrier_request_message (struct ofp_conn *connection, char *buf)
+{
+   /* All the messages received before the barrier are processed by now,
+    * so queue the reply and push the whole output queue to the socket */
+   struct ofp_header *barrier_request;
+   char *ret_buf;
+
+   barrier_request = (struct ofp_header *) buf;
+
+   ret_buf = ofp_buf_alloc (sizeof(struct ofp_header));
+   if (!ret_buf)
+      return 1;
+   memset(ret_buf,0,sizeof(struct ofp_header));
+
+   send_openflow_message (connection, 
+                          0, OFPT_BARRIER_REPLY, ntohl (barrier_request->xid), ret_buf);
+   return ofp_conn_flush (connection);
+}
+
 uint8_t
 process_async_get_config_request(struct ofp_conn *connection, char *buf)
 {
-   /* Form a echo Reply message and send it back via the same connection */
+   /* Reply with the slave and master mask of every event */
    struct ofp_header *async_request;
-   struct ofp_async_config *async_config_reply; 
+   struct ofp_async_config_prop_reasons *prop;
    char *ret_buf = NULL;
-   uint8_t ret;
+   uint16_t length;
+   uint32_t type;
 
    async_request = (struct ofp_header *) buf;
 
-   ret_buf = malloc (sizeof(struct ofp_async_config));
-   async_config_reply = (struct ofp_async_config *) ret_buf; 
-   memset(async_config_reply,0,sizeof(struct ofp_async_config));
-   
-   async_config_reply->properties[0].type = OFPACPT_PORT_STATUS_SLAVE;
-   async_config_reply->properties[0].length = sizeof (uint32_t);
-   
-   ret = send_openflow_message (connection, 
-                               0, OFPT_GET_CONFIG_REPLY, async_request->xid, ret_buf);
+   length = sizeof(struct ofp_async_config) +
+            (2 * OFP_ASYNC_N_EVENTS) * sizeof(struct ofp_async_config_prop_reasons);
+   ret_buf = ofp_buf_alloc (length);
+   if (!ret_buf)
+      return 1;
+   memset(ret_buf,0,length);
 
-   free (ret_buf);
-   return ret;
+   prop = (struct ofp_async_config_prop_reasons *)
+          (ret_buf + sizeof(struct ofp_async_config));
+   for (type=0;type<2 * OFP_ASYNC_N_EVENTS;type++,prop++) {
+      prop->type = htons(type);
+      prop->length = htons(sizeof(struct ofp_async_config_prop_reasons));
+      prop->mask = htonl(connection->async_config_mask[type]);
+   }
+
+   return send_openflow_message (connection, 
+                                 length - sizeof (struct ofp_header), 
+                                 OFPT_GET_ASYNC_REPLY, ntohl (async_request->xid), ret_buf);
 }
 
 uint8_t
 process_async_set_config_request(struct ofp_conn *connection, char *buf)
 {
-   /* Form a echo Reply message and send it back via the same connection */
+   /* Only the properties present change, and nothing changes if one
+    * of them is bad. The new masks are compiled into the per event
+    * bitmaps here, so sending an async message never looks at them. */
    struct ofp_async_config *async_set_config; 
-   char *ret_buf = NULL;
-   uint8_t ret;
+   struct ofp_async_config_prop_reasons *prop;
+   struct ofp_msg_view msg;
+   uint32_t mask[OFPACPT_MAX];
+   uint16_t length, offset, prop_len, type;
 
    async_set_config = (struct ofp_async_config *) buf;
+   length = ntohs(async_set_config->header.length);
+   msg.data = buf;
+   msg.length = length;
 
-   /* set the switch configuration here */ 
-   
-   return ret;
+   memcpy (mask, connection->async_config_mask, sizeof(mask));
+   for (offset = sizeof(struct ofp_async_config); offset < length; offset += prop_len) {
+      prop = ofp_msg_view_pull (&msg, offset, sizeof(struct ofp_async_config_prop_header));
+      if (!prop) {
+         send_error_message(connection, ntohl (async_set_config->header.xid),
+                            OFPET_BAD_REQUEST, OFPBRC_BAD_LEN);
+         return 1;
+      }
+      type = ntohs(prop->type);
+      prop_len = ntohs(prop->length);
+      if (type == OFPTFPT_EXPERIMENTER_SLAVE || type == OFPTFPT_EXPERIMENTER_MASTER) {
+         send_error_message(connection, ntohl (async_set_config->header.xid),
+                            OFPET_ASYNC_CONFIG_FAILED, OFPACFC_UNSUPPORTED);
+         return 1;
+      }
+      if (type >= 2 * OFP_ASYNC_N_EVENTS ||
+          prop_len != sizeof(struct ofp_async_config_prop_reasons) ||
+          !ofp_msg_view_pull (&msg, offset, prop_len)) {
+         send_error_message(connection, ntohl (async_set_config->header.xid),
+                            OFPET_ASYNC_CONFIG_FAILED, OFPACFC_INVALID);
+         return 1;
+      }
+      mask[type] = ntohl(prop->mask);
+   }
+
+   memcpy (connection->async_config_mask, mask, sizeof(mask));
+   ofp_ctrl_registry_update (connection);
+   return 0;
 }
 
-uint8_t 
-send_packet_in_message(struct ofp_conn *connection, uint8_t *packet,
-                       uint16_t pkt_length) 
+static struct ofp_pkt_buf_pool ofp_pkt_bufs;
+static ofp_packet_output_cb ofp_packet_output;
+
+/* Set by the datapath, packet-outs and buffered flow_mods are left
+ * alone until then */
+void
+ofp_set_packet_output (ofp_packet_output_cb cb)
+{
+   ofp_packet_output = cb;
+}
+
+/* Allocate the packet buffers announced in the features reply */
+uint8_t
+ofp_pkt_bufs_init (uint32_t n_buffers)
+{
+   struct ofp_pkt_buf_pool *pool = &ofp_pkt_bufs;
+   uint32_t i;
+
+   /* The last index is left out, so no buffer_id is OFP_NO_BUFFER */
+   if (n_buffers > OFP_PKT_BUF_INDEX_MASK)
+      n_buffers = OFP_PKT_BUF_INDEX_MASK;
+   pool->bufs = calloc (n_buffers, sizeof(struct ofp_pkt_buf));
+   pool->frames = malloc ((size_t) n_buffers * OFP_PKT_BUF_FRAME_MAX);
+   if (n_buffers && (!pool->bufs || !pool->frames)) {
+      free (pool->bufs);
+      free (pool->frames);
+      pool->bufs = NULL;
+      pool->frames = NULL;
+      return 1;
+   }
+   for (i=0;i<n_buffers;i++)
+      pool->bufs[i].next = (i + 1 < n_buffers) ? i + 1 : OFP_PKT_BUF_NONE;
+   pool->n = n_buffers;
+   pool->n_used = 0;
+   pool->free_head = n_buffers ? 0 : OFP_PKT_BUF_NONE;
+   pool->oldest = pool->newest = OFP_PKT_BUF_NONE;
+   ofp_switch.features.n_buffers = n_buffers;
+   ofp_switch_config_changed ();
+   return 0;
+}
+
+/* Give a used slot back to the free list */
+static void
+ofp_pkt_buf_release (struct ofp_pkt_buf_pool *pool, uint32_t i)
+{
+   struct ofp_pkt_buf *buf = &pool->bufs[i];
+
+   if (buf->prev != OFP_PKT_BUF_NONE)
+      pool->bufs[buf->prev].next = buf->next;
+   else
+      pool->oldest = buf->next;
+   if (buf->next != OFP_PKT_BUF_NONE)
+      pool->bufs[buf->next].prev = buf->prev;
+   else
+      pool->newest = buf->prev;
+   buf->used = FALSE;
+   buf->next = pool->free_head;
+   pool->free_head = i;
+   pool->n_used--;
+}
+
+/* Keep a packet for the controller. Returns its buffer_id, or
+ * OFP_NO_BUFFER if it cannot be buffered. When all the buffers are in
+ * use the oldest one is reused. */
+uint32_t
+ofp_pkt_buf_store (const uint8_t *packet, uint16_t len, uint32_t in_port,
+                   long long int now)
+{
+   struct ofp_pkt_buf_pool *pool = &ofp_pkt_bufs;
+   struct ofp_pkt_buf *buf;
+   uint32_t i;
+
+   if (!pool->n || len > OFP_PKT_BUF_FRAME_MAX)
+      return OFP_NO_BUFFER;
+   if (pool->free_head == OFP_PKT_BUF_NONE)
+      ofp_pkt_buf_release (pool, pool->oldest);
+   i = pool->free_head;
+   buf = &pool->bufs[i];
+   pool->free_head = buf->next;
+
+   buf->generation = (buf->generation + 1) & OFP_PKT_BUF_GEN_MASK;
+   buf->len = len;
+   buf->used = TRUE;
+   buf->in_port = in_port;
+   buf->stored = now;
+   buf->prev = pool->newest;
+   buf->next = OFP_PKT_BUF_NONE;
+   if (pool->newest != OFP_PKT_BUF_NONE)
+      pool->bufs[pool->newest].next = i;
+   else
+      pool->oldest = i;
+   pool->newest = i;
+   pool->n_used++;
+   memcpy (pool->frames + (size_t) i * OFP_PKT_BUF_FRAME_MAX, packet, len);
+   return ((uint32_t) buf->generation << OFP_PKT_BUF_INDEX_BITS) | i;
+}
+
+/* Look a buffer_id up, without claiming it */
+static uint32_t
+ofp_pkt_buf_find (uint32_t buffer_id, uint32_t *index)
+{
+   struct ofp_pkt_buf_pool *pool = &ofp_pkt_bufs;
+   uint32_t i = buffer_id & OFP_PKT_BUF_INDEX_MASK;
+
+   if (i >= pool->n)
+      return OFP_ERROR(OFPET_BAD_REQUEST, OFPBRC_BUFFER_UNKNOWN);
+   if (pool->bufs[i].generation != buffer_id >> OFP_PKT_BUF_INDEX_BITS)
+      return OFP_ERROR(OFPET_BAD_REQUEST, OFPBRC_BUFFER_UNKNOWN);
+   if (!pool->bufs[i].used)
+      return OFP_ERROR(OFPET_BAD_REQUEST, OFPBRC_BUFFER_EMPTY);
+   *index = i;
+   return 0;
+}
+
+/* Claim the packet of a buffer_id for a packet-out. The
+ * buffer is released, its frame stays valid until the next store. */
+uint32_t
+ofp_pkt_buf_take (uint32_t buffer_id, uint8_t **frame, uint16_t *len,
+                  uint32_t *in_port)
+{
+   struct ofp_pkt_buf_pool *pool = &ofp_pkt_bufs;
+   uint32_t i, error;
+
+   error = ofp_pkt_buf_find (buffer_id, &i);
+   if (error)
+      return error;
+   ofp_pkt_buf_release (pool, i);
+   *frame = pool->frames + (size_t) i * OFP_PKT_BUF_FRAME_MAX;
+   *len = pool->bufs[i].len;
+   *in_port = pool->bufs[i].in_port;
+   return 0;
+}
+
+/* Send a buffered packet through the datapath output path. Without one
+ * the buffer is only checked and stays in place. */
+static uint32_t
+ofp_pkt_buf_output (uint32_t buffer_id, const struct ofp_action_header *actions,
+                    uint16_t actions_len)
+{
+   uint8_t *frame;
+   uint16_t len;
+   uint32_t in_port, i, error;
+
+   if (!ofp_packet_output)
+      return ofp_pkt_buf_find (buffer_id, &i);
+   error = ofp_pkt_buf_take (buffer_id, &frame, &len, &in_port);
+   if (!error)
+      ofp_packet_output (frame, len, in_port, actions, actions_len);
+   return error;
+}
+
+/* Reclaim the buffers the controllers left unused. Slots are kept in
+ * store order, so only the expired ones are looked at. */
+void
+ofp_pkt_bufs_expire (long long int now)
+{
+   struct ofp_pkt_buf_pool *pool = &ofp_pkt_bufs;
+
+   while (pool->oldest != OFP_PKT_BUF_NONE &&
+          now - pool->bufs[pool->oldest].stored >= OFP_PKT_BUF_TIMEOUT_MSEC)
+      ofp_pkt_buf_release (pool, pool->oldest);
+}
+
+/* Buffer the packet unless the controller asked for whole packets, and
+ * then only send the first miss_send_len bytes of it. The header, the
+ * in_port match and the padding are encoded in a small buffer, the frame
+ * bytes go to the socket without being copied. */
+static uint8_t 
+ofp_packet_in_send (struct ofp_conn *connection, uint8_t *packet,
+                    uint16_t pkt_length, uint32_t in_port, uint8_t reason,
+                    uint8_t table_id, uint64_t cookie) 
 {
    char *send_buf=NULL;
    struct ofp_packet_in *packet_in = NULL;
-   uint8_t ret;
+   struct ofp_match *match;
+   uint32_t buffer_id = OFP_NO_BUFFER;
+   uint32_t oxm_header = OXM_HEADER (OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IN_PORT, 4);
+   uint16_t data_len = pkt_length, match_len, len;
    uint32_t xid = htonl(0);
 
-   send_buf = malloc (sizeof(struct ofp_packet_in));
+   if (connection->miss_send_len != OFPCML_NO_BUFFER)
+      buffer_id = ofp_pkt_buf_store (packet, pkt_length, in_port,
+                                     time_msec ());
+   if (buffer_id != OFP_NO_BUFFER && data_len > connection->miss_send_len)
+      data_len = connection->miss_send_len;
+
+   /* match with the in_port OXM, padded to 8 bytes, then 2 pad bytes */
+   match_len = sizeof(struct ofp_match) - 4 + 2 * sizeof(uint32_t);
+   len = offsetof(struct ofp_packet_in, match) + (match_len + 7) / 8 * 8 + 2;
+   send_buf = ofp_buf_alloc (len);
+   if (!send_buf)
+      return 1;
    packet_in = (struct ofp_packet_in *)send_buf;
-   memset(packet_in ,0,sizeof(struct ofp_packet_in));
+   memset(packet_in ,0,len);
 
-   packet_in->buffer_id = htonl(OFP_NO_BUFFER);
+   packet_in->buffer_id = htonl(buffer_id);
    packet_in->total_len = htons(pkt_length);
-   packet_in->reason = OFPR_TABLE_MISS;
-   packet_in->cookie = 0xFFFF;
-   memcpy (packet_in->data, packet, pkt_length);
+   packet_in->reason = reason;
+   packet_in->table_id = table_id;
+   packet_in->cookie = htonl_64 (cookie);
+   match = &packet_in->match;
+   match->type = htons (OFPMT_OXM);
+   match->length = htons (match_len);
+   oxm_header = htonl (oxm_header);
+   in_port = htonl (in_port);
+   memcpy (match->oxm_fields, &oxm_header, sizeof(uint32_t));
+   memcpy (match->oxm_fields + sizeof(uint32_t), &in_port, sizeof(uint32_t));
 
-   ret = send_openflow_message (connection, 
-                               (sizeof(struct ofp_packet_in) - sizeof (struct ofp_header)), 
-                               OFPT_PACKET_IN, xid, send_buf);
-   
-   free (send_buf);
-   return ret;
+   return send_openflow_message_sg (connection, len - sizeof (struct ofp_header),
+                                    OFPT_PACKET_IN, xid, send_buf, packet, data_len);
 }
 
-uint8_t 
-fill_match_field_buffer (struct ofp_match *dest_match, struct ofp_match *src_match)
+/* Packet-ins waiting in the limiter queues of all the connections */
+static uint32_t ofp_pin_n_queued;
+
+static void
+ofp_pin_refill (struct ofp_pin_reason *pin_reason, long long int now)
 {
-   struct oxm_tlv_field *oxm_tlv;
-   struct oxm_tlv_field *src_oxm_tlv;
-   uint32_t oxm_header;
-   uint32_t oxm_value;
-   dest_match->type = htons (src_match->type); 
-   if (src_match->type == OFPMT_OXM) {
-      if (src_match->length) {
-         dest_match->length = htons(sizeof(struct ofp_match) - 4);
-         oxm_tlv = malloc (sizeof(struct oxm_tlv_field));
-         dest_match->oxm_fields[0] = oxm_tlv;
-         src_oxm_tlv = (struct oxm_tlv_field *)src_match->oxm_fields[0];
-         memcpy(&oxm_header, src_oxm_tlv->oxm_header, sizeof(uint32_t));
-         oxm_tlv->oxm_header = htonl (oxm_header);
+   long long int msec = now - pin_reason->last;
+
+   if (msec <= 0)
+      return;
+   pin_reason->last = now;
+   if (msec > OFP_PIN_BURST * 1000LL / OFP_PIN_RATE + 1)
+      msec = OFP_PIN_BURST * 1000LL / OFP_PIN_RATE + 1;
+   pin_reason->tokens += msec * OFP_PIN_RATE;
+   if (pin_reason->tokens > OFP_PIN_BURST * 1000LL)
+      pin_reason->tokens = OFP_PIN_BURST * 1000LL;
+}
+
+static inline uint8_t *
+ofp_pin_frame (struct ofp_pin_reason *pin_reason, uint16_t index)
+{
+   return pin_reason->frames + (size_t) index * OFP_PKT_BUF_FRAME_MAX;
+}
+
+/* Allocate the frame slots of the packet-in queues */
+static uint8_t
+ofp_pin_limiter_init (struct ofp_pin_limiter *limiter)
+{
+   uint8_t reason;
+
+   limiter->frames = malloc ((size_t) OFP_PIN_N_REASONS * OFP_PIN_QUEUE_LEN *
+                             OFP_PKT_BUF_FRAME_MAX);
+   if (!limiter->frames)
+      return 1;
+   for (reason=0;reason<OFP_PIN_N_REASONS;reason++)
+      limiter->reasons[reason].frames = limiter->frames +
+         (size_t) reason * OFP_PIN_QUEUE_LEN * OFP_PKT_BUF_FRAME_MAX;
+   return 0;
+}
+
+static uint8_t
+ofp_pin_enqueue (struct ofp_pin_reason *pin_reason, uint8_t *packet, uint16_t pkt_length,
+                 uint32_t in_port, uint8_t table_id, uint64_t cookie)
+{
+   struct ofp_pin_queued *queued;
+   uint16_t index;
+
+   if (pin_reason->count == OFP_PIN_QUEUE_LEN || pkt_length > OFP_PKT_BUF_FRAME_MAX)
+      return 1;
+   index = (pin_reason->head + pin_reason->count) % OFP_PIN_QUEUE_LEN;
+   queued = &pin_reason->queue[index];
+   memcpy (ofp_pin_frame (pin_reason, index), packet, pkt_length);
+   queued->len = pkt_length;
+   queued->in_port = in_port;
+   queued->table_id = table_id;
+   queued->cookie = cookie;
+   pin_reason->count++;
+   pin_reason->n_queued++;
+   ofp_pin_n_queued++;
+   return 0;
+}
+
+/* Send the queued packet-ins of a connection the buckets have tokens
+ * for, oldest first */
+static void
+ofp_pin_drain (struct ofp_conn *connection, long long int now)
+{
+   struct ofp_pin_reason *pin_reason;
+   struct ofp_pin_queued *queued;
+   uint8_t reason;
+
+   for (reason=0;reason<OFP_PIN_N_REASONS;reason++) {
+      pin_reason = &connection->pin_limiter.reasons[reason];
+      if (!pin_reason->count)
+         continue;
+      ofp_pin_refill (pin_reason, now);
+      while (pin_reason->count && pin_reason->tokens >= 1000) {
+         queued = &pin_reason->queue[pin_reason->head];
+         pin_reason->tokens -= 1000;
+         pin_reason->n_sent++;
+         ofp_packet_in_send (connection, ofp_pin_frame (pin_reason, pin_reason->head),
+                             queued->len, queued->in_port, reason,
+                             queued->table_id, queued->cookie);
+         pin_reason->head = (pin_reason->head + 1) % OFP_PIN_QUEUE_LEN;
+         pin_reason->count--;
+         ofp_pin_n_queued--;
+      }
+   }
+}
+
+/* Drop the queued packet-ins of a connection going away */
+static void
+ofp_pin_purge (struct ofp_conn *connection)
+{
+   uint8_t reason;
+
+   for (reason=0;reason<OFP_PIN_N_REASONS;reason++) {
+      ofp_pin_n_queued -= connection->pin_limiter.reasons[reason].count;
+      connection->pin_limiter.reasons[reason].count = 0;
+   }
+   free (connection->pin_limiter.frames);
+   connection->pin_limiter.frames = NULL;
+}
+
+/* Packet-in to a controller, through the limiter of the connection,
+ * which is checked before anything is encoded. 'flow_hash' identifies
+ * the flow of the packet: flows sent to the controller a moment ago
+ * come after the ones it has not seen yet. */
+uint8_t 
+send_packet_in_message(struct ofp_conn *connection, uint8_t *packet,
+                       uint16_t pkt_length, uint32_t in_port, uint8_t reason,
+                       uint8_t table_id, uint64_t cookie, uint32_t flow_hash) 
+{
+   struct ofp_pin_limiter *limiter = &connection->pin_limiter;
+   struct ofp_pin_reason *pin_reason;
+   uint32_t slot = flow_hash % OFP_PIN_RECENT_SLOTS;
+   long long int now = time_msec ();
+   int64_t floor = 0;
+
+   if (reason >= OFP_PIN_N_REASONS)
+      return 1;
+   /* Masked off by the async config: not even encoded */
+   if (!(connection->async_wanted[OFP_ASYNC_PACKET_IN] & (1u << reason)))
+      return 0;
+   pin_reason = &limiter->reasons[reason];
+   ofp_pin_refill (pin_reason, now);
+   if (limiter->recent_hash[slot] == flow_hash &&
+       now - limiter->recent_time[slot] < OFP_PIN_RECENT_MSEC)
+      floor = OFP_PIN_BURST * 1000LL / 2;
+   else if (pin_reason->count || pin_reason->tokens < 1000) {
+      /* Behind the queued ones, or dropped if the queue is full */
+      if (ofp_pin_enqueue (pin_reason, packet, pkt_length, in_port, table_id, cookie))
+         pin_reason->n_dropped++;
+      return 0;
+   }
+   if (pin_reason->tokens < floor + 1000) {
+      pin_reason->n_dropped++;
+      return 0;
+   }
+   pin_reason->tokens -= 1000;
+   pin_reason->n_sent++;
+   limiter->recent_hash[slot] = flow_hash;
+   limiter->recent_time[slot] = now;
+   return ofp_packet_in_send (connection, packet, pkt_length, in_port, reason,
+                              table_id, cookie);
+}
+
+uint8_t 
+fill_match_field_buffer (struct ofp_match *dest_match, struct ofp_match *src_match)
+{
+   struct oxm_tlv_field *oxm_tlv;
+   struct oxm_tlv_field *src_oxm_tlv;
+   uint32_t oxm_header;
+   uint32_t oxm_value;
+   dest_match->type = htons (src_match->type); 
+   if (src_match->type == OFPMT_OXM) {
+      if (src_match->length) {
+         dest_match->length = htons(sizeof(struct ofp_match) - 4);
+         oxm_tlv = malloc (sizeof(struct oxm_tlv_field));
+         dest_match->oxm_fields[0] = oxm_tlv;
+         src_oxm_tlv = (struct oxm_tlv_field *)src_match->oxm_fields[0];
+         memcpy(&oxm_header, src_oxm_tlv->oxm_header, sizeof(uint32_t));
+         oxm_tlv->oxm_header = htonl (oxm_header);
          if ((OXM_FIELD(src_oxm_tlv->oxm_header) == OFPXMT_OFB_IN_PORT) ||
              (OXM_FIELD(src_oxm_tlv->oxm_header) == OXM_OF_IPV4_SRC) ||
              (OXM_FIELD(src_oxm_tlv->oxm_header) == OXM_OF_IPV4_DST) ||
@@ -308,20 +1112,22 @@ fill_match_field_buffer (struct ofp_match *dest_match, struct ofp_match *src_mat
 
 }
 
-uint8_t 
-send_flow_removed_message(struct ofp_conn *connection, struct openflow_entry *flow_entry,
-                         enum ofp_flow_removed_reason reason) 
+/* Asynchronous messages are encoded apart from any connection, so
+ * that one encoding can go to all the controllers which want it */
+static void *
+ofp_flow_removed_encode (struct openflow_entry *flow_entry, enum ofp_flow_removed_reason reason,
+                         uint16_t *length)
 {
    char *buf = NULL;
    struct ofp_flow_removed *flow_removed_msg = NULL;
-   uint8_t ret;
-   uint32_t xid = htonl(0);
    long long int duration_in_msecs = 0;
    uint32_t duration_in_secs = 0;
    uint32_t duration_in_nsecs = 0;
    uint8_t match_ptr = NULL;
 
-   buf = malloc (sizeof(struct ofp_flow_removed));
+   buf = ofp_buf_alloc (sizeof(struct ofp_flow_removed));
+   if (!buf)
+      return NULL;
    flow_removed_msg = (struct ofp_flow_removed *) buf;
    memset(flow_removed_msg,0,sizeof(struct ofp_flow_removed));
 
@@ -341,110 +1147,239 @@ send_flow_removed_message(struct ofp_conn *connection, struct openflow_entry *fl
    flow_removed_msg->byte_count =  htonl_64 (flow_entry->byte_count);
    fill_match_field_buffer(&flow_removed_msg->match,&flow_entry->match);
 
-   /* TODO check the size */
-   ret = send_openflow_message (connection, 
-                               (sizeof(struct ofp_flow_removed) - sizeof (struct ofp_header)), 
-                               OFPT_FLOW_REMOVED, xid, buf);
-   
-   free (buf);
-   return ret;
+   /* The match is the fixed ofp_match header the flow was added with,
+    * already padded to 8 bytes, so the message has its fixed size */
+   *length = sizeof(struct ofp_flow_removed) - sizeof (struct ofp_header);
+   return buf;
 }
 
 uint8_t 
-send_port_status_message(struct ofp_conn *connection, struct ofp_port *port,
-                         enum ofp_port_reason reason) 
+send_flow_removed_message(struct ofp_conn *connection, struct openflow_entry *flow_entry,
+                         enum ofp_flow_removed_reason reason) 
 {
+   uint16_t length;
+   void *buf = ofp_flow_removed_encode (flow_entry, reason, &length);
+
+   if (!buf)
+      return 1;
+   return send_openflow_message (connection, length, OFPT_FLOW_REMOVED, htonl(0), buf);
+}
+
+static void *
+ofp_port_status_encode (struct ofp_port *port, enum ofp_port_reason reason, uint16_t *length)
+{
+   /* The port description carries its ethernet property */
+   uint16_t msg_len = sizeof(struct ofp_port_status) +
+                      sizeof(struct ofp_port_desc_prop_ethernet);
    char *buf = NULL;
    struct ofp_port_status *port_status_msg = NULL;
-   uint8_t ret;
-   uint32_t xid = htonl(0);
 
-   buf = malloc (sizeof(struct ofp_port_status));
+   buf = ofp_buf_alloc (msg_len);
+   if (!buf)
+      return NULL;
    port_status_msg = (struct ofp_port_status *)buf;
-   memset(port_status_msg ,0,sizeof(struct ofp_port_status));
+   memset(port_status_msg ,0,msg_len);
 
    port_status_msg->reason = reason;
    port_status_msg->desc.port_no = htonl(port->port_no); 
-   port_status_msg->desc.length = htons(port->length); 
+   port_status_msg->desc.length = htons(sizeof(struct ofp_port) +
+                                        sizeof(struct ofp_port_desc_prop_ethernet)); 
    memcpy (port_status_msg->desc.hw_addr, port->hw_addr, ETHHDR_ADDR_LEN);
    memcpy (port_status_msg->desc.name, port->name, MAX_PORT_NAME_LEN);
    port_status_msg->desc.config = htonl(port->config);
    port_status_msg->desc.state = htonl(port->state);
    port_status_msg->desc.properties[0].type = htons(port->properties[0].type);
-   port_status_msg->desc.properties[0].length = htons(port->properties[0].length);
+   port_status_msg->desc.properties[0].length = htons(sizeof(struct ofp_port_desc_prop_ethernet));
    port_status_msg->desc.properties[0].curr = htonl(port->properties[0].curr);
    port_status_msg->desc.properties[0].advertised = htonl(port->properties[0].advertised);
    port_status_msg->desc.properties[0].supported = htonl(port->properties[0].supported);
    port_status_msg->desc.properties[0].peer = htonl(port->properties[0].peer);
    port_status_msg->desc.properties[0].curr_speed = htonl(port->properties[0].curr_speed);
    port_status_msg->desc.properties[0].max_speed = htonl(port->properties[0].max_speed);
-   /* TODO check the size */
-   ret = send_openflow_message (connection, 
-                               (sizeof(struct ofp_port_status) - sizeof (struct ofp_header)), 
-                               OFPT_PORT_STATUS, xid, buf);
-   
-   free (buf);
-   return ret;
+   *length = msg_len - sizeof (struct ofp_header);
+   return buf;
 }
 
 uint8_t 
-send_role_status_message(struct ofp_conn *connection, enum ofp_controller_role role,
+send_port_status_message(struct ofp_conn *connection, struct ofp_port *port,
                          enum ofp_port_reason reason) 
+{
+   uint16_t length;
+   void *buf = ofp_port_status_encode (port, reason, &length);
+
+   if (!buf)
+      return 1;
+   return send_openflow_message (connection, length, OFPT_PORT_STATUS, htonl(0), buf);
+}
+
+static void *
+ofp_role_status_encode (enum ofp_controller_role role, enum ofp_controller_role_reason reason,
+                        uint64_t generation_id, uint16_t *length)
 {
    char *buf = NULL;
    struct ofp_role_status *role_status_msg = NULL;
-   uint8_t ret;
-   uint32_t xid = htonl(0);
 
-   buf = malloc (sizeof(struct ofp_role_status));
+   buf = ofp_buf_alloc (sizeof(struct ofp_role_status));
+   if (!buf)
+      return NULL;
    role_status_msg = (struct ofp_role_status *)buf;
    memset(role_status_msg,0,sizeof(struct ofp_role_status));
 
    role_status_msg->role = htonl(role);
    role_status_msg->reason = reason;
-   role_status_msg->generation_id = htonl_64(connection->generation_id);
+   role_status_msg->generation_id = htonl_64(generation_id);
 
-   /* TODO check the size */
-   ret = send_openflow_message (connection, 
-                               (sizeof(struct ofp_role_status) - sizeof (struct ofp_header)), 
-                               OFPT_ROLE_STATUS, xid, buf);
-   
-   free (buf);
-   return ret;
+   /* No role properties are sent */
+   *length = sizeof(struct ofp_role_status) - sizeof (struct ofp_header);
+   return buf;
 }
 
 uint8_t 
-send_table_status_message(struct ofp_conn *connection, struct ofp_table_desc *table_config,
-                         enum ofp_port_reason reason) 
+send_role_status_message(struct ofp_conn *connection, enum ofp_controller_role role,
+                         enum ofp_controller_role_reason reason) 
+{
+   uint16_t length;
+   void *buf = ofp_role_status_encode (role, reason, connection->generation_id, &length);
+
+   if (!buf)
+      return 1;
+   return send_openflow_message (connection, length, OFPT_ROLE_STATUS, htonl(0), buf);
+}
+
+/* A controller became master: the other masters become slaves, and
+ * the ones which want to know get a single role status encoding */
+static void
+ofp_ctrl_demote_masters (struct ofp_conn *master, uint64_t generation_id)
+{
+   struct ofp_ctrl_registry *registry = &ofp_reactor.registry;
+   struct ofp_conn *connection;
+   uint64_t used, demoted = 0;
+   uint16_t length;
+   uint32_t slot;
+   void *buf;
+
+   for (used = registry->used; used; used &= used - 1) {
+      slot = __builtin_ctzll (used);
+      connection = registry->slots[slot];
+      if (connection == master || connection->role != OFPCR_ROLE_MASTER)
+         continue;
+      connection->role = OFPCR_ROLE_SLAVE;
+      ofp_ctrl_registry_update (connection);
+      demoted |= 1ULL << slot;
+   }
+   demoted &= ofp_async_subscribers (OFP_ASYNC_ROLE_STATUS, OFPCRR_MASTER_REQUEST);
+   if (demoted && (buf = ofp_role_status_encode (OFPCR_ROLE_SLAVE, OFPCRR_MASTER_REQUEST,
+                                                 generation_id, &length)))
+      ofp_async_publish (demoted, OFPT_ROLE_STATUS, buf, length);
+}
+
+uint8_t
+process_role_request_message (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_role_request *role_request;
+   struct ofp_role_request *role_reply;
+   uint64_t generation_id;
+   uint32_t role;
+   char *ret_buf;
+
+   role_request = (struct ofp_role_request *) buf;
+   role = ntohl (role_request->role);
+   generation_id = ntohl_64 (role_request->generation_id);
+
+   /* Validate the generation_id. Here the generation_is_defined i
+    * and cached_generation_id are global variables */
+   if (generation_is_defined && (int64_t) 
+       (generation_id - cached_generation_id) < 0) {
+
+     /* If it is a stale message then send error message */
+     send_error_message(connection, ntohl (role_request->header.xid), OFPET_ROLE_REQUEST_FAILED, OFPRRFC_STALE);
+   }
+   else {
+      if (role != OFPCR_ROLE_NOCHANGE) {
+         ret_buf = ofp_buf_alloc (sizeof(struct ofp_role_request));
+         if (!ret_buf)
+            return 1;
+         cached_generation_id = generation_id;
+         generation_is_defined = TRUE;
+
+         /* At most one master: the others become slaves */
+         if (role == OFPCR_ROLE_MASTER)
+            ofp_ctrl_demote_masters (connection, generation_id);
+
+         /* set the role of the connection */
+         connection->role = role;
+         ofp_ctrl_registry_update (connection);
+
+         /* form the reply message and send it to controller*/
+         role_reply = (struct ofp_role_request *) ret_buf;
+         memset(role_reply,0,sizeof(struct ofp_role_request));
+
+         role_reply->role = htonl(role);
+         role_reply->generation_id = htonl_64(generation_id);
+         
+         return send_openflow_message (connection, 
+                                       (sizeof(struct ofp_role_request) - sizeof (struct ofp_header)), 
+                                       OFPT_ROLE_REPLY, ntohl (role_request->header.xid), ret_buf);
+      }
+   }
+   return 0;
+}
+
+/* Length of a table description with its eviction and vacancy
+ * properties, as carried by table status messages */
+#define OFP_TABLE_DESC_LEN (sizeof(struct ofp_table_desc) + \
+                            sizeof(struct ofp_table_mod_prop_eviction) + \
+                            sizeof(struct ofp_table_mod_prop_vacancy))
+
+static void *
+ofp_table_status_encode (struct openflow_table *table, enum ofp_table_reason reason,
+                         uint16_t *length)
 {
    char *buf = NULL;
    struct ofp_table_status *table_status_msg = NULL;
-   uint8_t ret;
-   uint32_t xid = htonl(0);
-   uint32_t eviction_flag = 0;
+   struct ofp_table_mod_prop_eviction *eviction_prop;
+   struct ofp_table_mod_prop_vacancy *vacancy_prop;
 
-   buf = malloc (sizeof(struct ofp_table_status));
+   buf = ofp_buf_alloc (sizeof(struct ofp_table_status) + OFP_TABLE_DESC_LEN - 
+                        sizeof(struct ofp_table_desc));
+   if (!buf)
+      return NULL;
    table_status_msg = (struct ofp_table_status *)buf;
-   memset(table_status_msg,0,sizeof(struct ofp_table_status));
+   memset(table_status_msg,0,sizeof(struct ofp_table_status) + OFP_TABLE_DESC_LEN - 
+                             sizeof(struct ofp_table_desc));
 
    table_status_msg->reason = reason;
-   table_status_msg->table.length = table_config->length;
-   table_status_msg->table.table_id = htons (table_config->table_id);
-   table_status_msg->table.config = htonl (table_config->config);
-   table_status_msg->table.properties[0].type = table_config->properties[0].type;
-   table_status_msg->table.properties[0].length = table_config->properties[0].length;
-   if (table_config->properties[0].type == OFPTMPT_EVICTION) {
-      memcpy(&eviction_flag, (&table_config->properties[0]+4), sizeof(uint32_t));
-      /* TODO Need to fill the eviction flag here */
-   }
+   table_status_msg->table.length = htons (OFP_TABLE_DESC_LEN);
+   table_status_msg->table.table_id = table->table_id;
+   table_status_msg->table.config = htonl (table->config_flag);
 
-   /* TODO check the size */
-   ret = send_openflow_message (connection, 
-                               (sizeof(struct ofp_table_status) - sizeof (struct ofp_header)), 
-                               OFPT_TABLE_STATUS, xid, buf);
-   
-   free (buf);
-   return ret;
+   eviction_prop = (struct ofp_table_mod_prop_eviction *) &table_status_msg->table.properties[0];
+   eviction_prop->type = htons (OFPTMPT_EVICTION);
+   eviction_prop->length = htons (sizeof(struct ofp_table_mod_prop_eviction));
+   eviction_prop->flags = htonl (table->eviction_flag);
+
+   vacancy_prop = (struct ofp_table_mod_prop_vacancy *) (eviction_prop + 1);
+   vacancy_prop->type = htons (OFPTMPT_VACANCY);
+   vacancy_prop->length = htons (sizeof(struct ofp_table_mod_prop_vacancy));
+   vacancy_prop->vacancy_down = table->vacancy_down;
+   vacancy_prop->vacancy_up = table->vacancy_up;
+   vacancy_prop->vacancy = table->vacancy;
+
+   *length = sizeof(struct ofp_table_status) + OFP_TABLE_DESC_LEN - 
+             sizeof(struct ofp_table_desc) - sizeof (struct ofp_header);
+   return buf;
+}
+
+uint8_t 
+send_table_status_message(struct ofp_conn *connection, struct openflow_table *table,
+                          enum ofp_table_reason reason) 
+{
+   uint16_t length;
+   void *buf = ofp_table_status_encode (table, reason, &length);
+
+   if (!buf)
+      return 1;
+   return send_openflow_message (connection, length, OFPT_TABLE_STATUS, htonl(0), buf);
 }
 
 uint8_t 
@@ -455,7 +1390,9 @@ send_request_forward_message(struct ofp_conn *connection, struct ofp_header *req
    uint8_t ret;
    uint32_t xid = htonl(0);
 
-   buf = malloc (sizeof(struct ofp_requestforward_header));
+   buf = ofp_buf_alloc (sizeof(struct ofp_requestforward_header));
+   if (!buf)
+      return 1;
    req_forward_msg = (struct ofp_requestforward_header *) buf;
    memset(req_forward_msg,0,sizeof(struct ofp_requestforward_header));
    req_forward_msg->request.type = request->type;
@@ -469,451 +1406,3121 @@ send_request_forward_message(struct ofp_conn *connection, struct ofp_header *req
                                (sizeof(struct ofp_requestforward_header) - sizeof (struct ofp_header)), 
                                OFPT_REQUESTFORWARD, xid, buf);
    
-   free (buf);
    return ret;
 }
 
-uint8_t
-process_packet_out_message (struct ofp_conn *connection, struct ofp_packet_out *packet)
+static inline uint32_t
+ofp_id_index_id (const struct ofp_id_index *index, const void *entry)
 {
-   struct ofp_role_request *role_reply;
-   uint8_t ret;
+   return *(const uint32_t *) ((const char *) entry + index->id_offset);
+}
+
+/* Entry of 'id' in the index, or NULL */
+static void *
+ofp_id_index_find (const struct ofp_id_index *index, uint32_t id)
+{
+   void *entry;
+   uint32_t i;
 
-   if (packet->buffer_id == OFP_NO_BUFFER) {
-     /* call the function which sends the packet via the switch port */
+   if (!index->slots)
+      return NULL;
+   for (i = ofp_hash_uint32 (id) & index->mask;
+        (entry = index->slots[i]) != NULL;
+        i = (i + 1) & index->mask) {
+      if (ofp_id_index_id (index, entry) == id)
+         return entry;
    }
-   else {
-     /* retrieve the packet which are buffered */
-   } 
-   return 0;   
+   return NULL;
 }
 
-uint8_t
-process_table_modify_message (struct ofp_conn *connection, char *buf)
+static void
+ofp_id_index_place (struct ofp_id_index *index, void *entry)
 {
-   struct ofp_table_mod *table_modify_msg = (struct ofp_table_mod *) (buf);
-   int i;
-   uint8_t table_id = ntohs(table_modify_msg->table_id);
-   uint32_t config_flag = ntohl (table_modify_msg->config);
+   uint32_t i = ofp_hash_uint32 (ofp_id_index_id (index, entry)) & index->mask;
 
-   if (table_id == OFPTT_ALL) {
-      for (i=0;i<ofp_switch.features.n_tables;i++) {  
-         if (config_flag == OFPTC_EVICTION) {
-            struct ofp_table_mod_prop_eviction *eviction_prop = (struct ofp_table_mod_prop_eviction *)&(table_modify_msg->properties[0]);
-            ofp_switch.features.tables[i].eviction_flag = ntohl (eviction_prop->flags);
-         }
-         else if (config_flag == OFPTC_VACANCY_EVENTS){
-            struct ofp_table_mod_prop_vacancy *vacancy_prop = (struct ofp_table_mod_prop_vacancy *)&(table_modify_msg->properties[0]);
-            ofp_switch.features.tables[i].vacancy_down = ntohs (vacancy_prop->vacancy_down);
-            ofp_switch.features.tables[i].vacancy_up = ntohs (vacancy_prop->vacancy_up);
-            ofp_switch.features.tables[i].vacancy = ntohs (vacancy_prop->vacancy);
-         }
-      }
-   }
-   else {
-      if (config_flag == OFPTC_EVICTION) {
-         struct ofp_table_mod_prop_eviction *eviction_prop = (struct ofp_table_mod_prop_eviction *)&(table_modify_msg->properties[0]);
-         ofp_switch.features.tables[table_id].eviction_flag = ntohl (eviction_prop->flags);
-       }
-       else if (config_flag == OFPTC_VACANCY_EVENTS){
-          struct ofp_table_mod_prop_vacancy *vacancy_prop = (struct ofp_table_mod_prop_vacancy *)&(table_modify_msg->properties[0]);
-          ofp_switch.features.tables[i].vacancy_down = ntohs (vacancy_prop->vacancy_down);
-          ofp_switch.features.tables[i].vacancy_up = ntohs (vacancy_prop->vacancy_up);
-          ofp_switch.features.tables[i].vacancy = ntohs (vacancy_prop->vacancy);
-       }
-   }
-   return 0;
+   while (index->slots[i])
+      i = (i + 1) & index->mask;
+   index->slots[i] = entry;
 }
 
-uint8_t
-process_flow_modify_message (struct ofp_conn *connection, char *buf)
+/* Make room for one more entry, growing the index so it stays at most
+ * half full and probe sequences stay short */
+static uint8_t
+ofp_id_index_reserve (struct ofp_id_index *index)
 {
-   struct ofp_flow_mod *flow_modify_msg = (struct ofp_flow_mod *) (buf);
-   uint16_t flag;
-   struct openflow_entry *flow_entry;
-   flow_entry = malloc (sizeof (struct openflow_entry));
-   flow_entry->cookie = ntohl_64 (flow_modify_msg->cookie); /* TODO define this ntohl*/
-   flow_entry->table_id = ntohs(flow_modify_msg->table_id);
-   flow_entry->idle_timeout = flow_modify_msg->idle_timeout;
-   flow_entry->hard_timeout = flow_modify_msg->hard_timeout;
-   flow_entry->priority = flow_modify_msg->priority;
-   flag  = flow_modify_msg->flags;
-   flow_entry->importance = flow_modify_msg->importance;
-   memcpy(&flow_entry->match,&flow_modify_msg->match, sizeof(struct ofp_match)); 
-   if (ntohs (flow_modify_msg->command) == OFPFC_ADD) {
-      /* Based on the flow entry implementation install it in the h/w */
-   }
-   else if (ntohs (flow_modify_msg->command) == OFPFC_DELETE) {
-      /* Based on the flow entry implementation delete it from the h/w */   
+   void **old_slots = index->slots;
+   uint32_t old_size = old_slots ? index->mask + 1 : 0;
+   uint32_t size = old_size ? old_size : 64;
+   uint32_t i;
+
+   while ((index->n + 1) * 2 > size)
+      size *= 2;
+   if (size == old_size)
+      return 0;
+   index->slots = calloc (size, sizeof(void *));
+   if (!index->slots) {
+      index->slots = old_slots;
+      return 1;
    }
-   else {
-      /* Based on the flow entry implementation modify the existing entry in h/w */   
+   index->mask = size - 1;
+   for (i=0;i<old_size;i++) {
+      if (old_slots[i])
+         ofp_id_index_place (index, old_slots[i]);
    }
+   free (old_slots);
    return 0;
 }
 
-uint8_t
-process_group_modify_add_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+/* Only after ofp_id_index_reserve */
+static void
+ofp_id_index_link (struct ofp_id_index *index, void *entry)
 {
-   uint16_t flag = 0;
-   uint16_t i,j;
-   uint16_t no_of_bucket = 0;
-   uint16_t no_of_actions = 0;
-   struct openflow_group_entry *group_entry = NULL;
-   struct openflow_group_entry *tmp_group_entry = NULL;
-   struct openflow_group_entry *position_to_insert = NULL;
-   struct ofp_switch_bucket *ofs_bucket = NULL;
-   struct ofp_switch_bucket *prev_bucket = NULL;
-   struct ofp_bucket *msg_bucket = NULL;
-   struct ofp_action_header *msg_action = NULL;
-   struct ofp_switch_acts *prev_action = NULL;
-   struct ofp_switch_acts *ofpacts = NULL;
-   uint32_t group_id = nthol(group_modify_msg->group_id);
+   ofp_id_index_place (index, entry);
+   index->n++;
+}
 
-   if (IS_GROUP_ALREADY_EXISTS(group_id)) {
-     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_GROUP_EXISTS);
-     return  0;
-   }
+/* Remove from the index, shifting back the entries probed past the
+ * freed slot so lookups never need tombstones */
+static void
+ofp_id_index_unlink (struct ofp_id_index *index, void *entry)
+{
+   uint32_t mask = index->mask;
+   uint32_t i, j, home;
 
-   if (ofp_switch.group_table->total_group_count > OFPG_MAX) {
-     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
-     return  0;
+   i = ofp_hash_uint32 (ofp_id_index_id (index, entry)) & mask;
+   while (index->slots[i] != entry)
+      i = (i + 1) & mask;
+   index->slots[i] = NULL;
+   index->n--;
+
+   for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask) {
+      home = ofp_hash_uint32 (ofp_id_index_id (index, index->slots[j])) & mask;
+      /* can the entry at j move to the hole at i? */
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+         index->slots[i] = index->slots[j];
+         index->slots[j] = NULL;
+         i = j;
+      }
    }
+}
 
-   group_entry = malloc (sizeof (struct openflow_group_entry));
+static void
+ofp_id_index_clear (struct ofp_id_index *index)
+{
+   if (index->slots)
+      memset (index->slots, 0, (index->mask + 1) * sizeof(void *));
+   index->n = 0;
+}
 
-   group_entry->type = ntohs (group_modify_msg->type); 
-   group_entry->group_id = ntohl (group_modify_msg->group_id); 
-   //group_count = ofp_switch.group_table->total_group_count;
-   tmp_group_entry = ofp_switch.group_table->group_entry;
-   while (tmp_group_entry) {
-     position_to_insert = tmp_group_entry; 
-     tmp_group_entry = tmp_group_entry->list_node.next;
-   }
-   position_to_insert->list_node.next = group_entry;
-   group_entry->list_node.prev = position_to_insert;
-
-   for (i=0;i<no_of_bucket;i++) {
-     ofs_bucket = malloc (sizeof (struct ofp_switch_bucket));
-     msg_bucket = &group_modify_msg->buckets[i];
-     prev_bucket = msg_bucket;
-     ofs_bucket->weight = msg_bucket->weight;
-     ofs_bucket->watch_port = ntohl(msg_bucket->watch_port);
-     ofs_bucket->watch_group = ntohl(msg_bucket->watch_group);
-     msg_action = msg_bucket->actions;
-     for (j=0;j<no_of_actions;j++) {
-        ofpacts = malloc (sizeof (struct ofp_switch_acts));
-        prev_action = ofpacts;
-        ofpacts->header.len = msg_action->len;
-        ofpacts->header.type = msg_action->type;
-        if (msg_action->type == OFPAT_OUTPUT) {
-          struct ofp_action_output *msg_output = (struct ofp_action_output *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.output.port = nthol(msg_output->port);
-          ofpacts->action.output.max_len= nthol(msg_output->max_len);
-        }
-        else if (msg_action->type == OFPAT_GROUP) {
-          struct ofp_action_group *msg_group = (struct ofp_action_group *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.group.group_id = nthol(msg_group->group_id);
-        }
-        else if (msg_action->type == OFPAT_SET_QUEUE) {
-          struct ofp_action_set_queue *msg_set_queue = (struct ofp_action_set_queue *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.queue.queue_id = nthol(msg_set_queue->queue_id);
-        }
-        else if (msg_action->type == OFPAT_SET_MPLS_TTL) {
-          struct ofp_action_mpls_ttl *msg_mpls_ttl = (struct ofp_action_mpls_ttl *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.mpls_ttl.mpls_ttl = nthos(msg_mpls_ttl->mpls_ttl);
-        }
-        else if (msg_action->type == OFPAT_SET_NW_TTL) {
-          struct ofp_action_nw_ttl *msg_nw_ttl = (struct ofp_action_nw_ttl *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.nw_ttl.nw_ttl = nthos(msg_nw_ttl->nw_ttl);
-        }
-        else if ((msg_action->type == OFPAT_PUSH_VLAN) ||
-                 (msg_action->type == OFPAT_PUSH_MPLS) ||
-                 (msg_action->type == OFPAT_PUSH_PBB)) {
-          struct ofp_action_push *msg_push = (struct ofp_action_push *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.push.ethertype = msg_push->ethertype;
-        }
-        else if (msg_action->type == OFPAT_POP_MPLS) {
-          struct ofp_action_pop_mpls *msg_pop_mpls = (struct ofp_action_pop_mpls *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          ofpacts->action.pop_mpls.ethertype = msg_pop_mpls->ethertype;
-        }
-        else if (msg_action->type == OFPAT_SET_FIELD) {
-          struct ofp_action_set_field *msg_set_field = (struct ofp_action_set_field *) 
-                  (msg_action + sizeof(struct ofp_action_header));
-          memcpy(&ofpacts->action.set_field.field, &msg_set_field->field, sizeof(uint32_t));
-        }
-        else if ((msg_action->type == OFPAT_COPY_TTL_OUT) ||
-                 (msg_action->type == OFPAT_COPY_TTL_IN) ||
-                 (msg_action->type == OFPAT_DEC_MPLS_TTL) ||
-                 (msg_action->type == OFPAT_DEC_NW_TTL) ||
-                 (msg_action->type == OFPAT_POP_VLAN) ||
-                 (msg_action->type == OFPAT_POP_PBB)) {
-          /* ignore this as these actions doesn't have any datas. */
-        }
-        if (j==0)
-           ofs_bucket->ofpacts_list = ofpacts;
-        else {
-           ofpacts->list_node.prev = prev_action;
-           prev_action->list_node.next = ofpacts;
-        }
-      }
-     if (i==0)
-        group_entry->bucket_list = ofs_bucket;
-     else {
-        ofs_bucket->list_node.prev = prev_bucket;
-        prev_bucket->list_node.next = ofs_bucket;
-     }
-   }
-   return 0;
+static inline void *
+ofp_entry_list_entry (const struct ofp_entry_list *list, struct list *node)
+{
+   return node ? (char *) node - list->node_offset : NULL;
 }
 
-uint8_t
-ofp_delete_group (struct openflow_group_entry *group_entry)
+static inline struct list *
+ofp_entry_list_node (const struct ofp_entry_list *list, void *entry)
 {
-   uint16_t i,j;
-   uint16_t no_of_bucket = 0;
-   uint16_t no_of_actions = 0;
-   struct ofp_switch_bucket *bucket = group_entry->bucket_list;
-   struct ofp_switch_bucket *next_bucket = NULL;
-   for (i=0;i<no_of_bucket;i++) {
-      struct ofp_switch_acts *ofp_acts = bucket->ofpacts_list;
-      struct ofp_switch_acts *next_act = NULL;
-      for (j=0;j<no_of_actions;j++) {
-         next_act = ofp_acts->list_node.next;
-         free (next_act);
-         ofp_acts = next_act;
-      }
-      next_bucket = bucket->list_node.next;
-      free (bucket);
-      bucket = next_bucket;
-   }
-   return 0;
+   return (struct list *) ((char *) entry + list->node_offset);
 }
-uint8_t
-process_group_add_modify_del_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+
+static inline void *
+ofp_entry_list_first (const struct ofp_entry_list *list)
 {
-   struct openflow_group_entry *group_entry = NULL;
-   struct openflow_group_entry *prev_group_entry = NULL;
-   struct openflow_group_entry *next_group_entry = NULL;
-   bool delete_all = FALSE;
-   uint32_t group_id;
+   return ofp_entry_list_entry (list, list->first);
+}
 
-   group_id = ntohl (group_modify_msg->group_id); 
+static inline void *
+ofp_entry_list_next (const struct ofp_entry_list *list, void *entry)
+{
+   return ofp_entry_list_entry (list, ofp_entry_list_node (list, entry)->next);
+}
 
-   if (!IS_GROUP_ALREADY_EXISTS(group_id)) {
-     return  0;
-   }
-   else if (group_id == OFPG_ALL) {
-     delete_all = TRUE;
-   }
-   group_entry = ofp_switch.group_table->group_entry;
+static void
+ofp_entry_list_append (struct ofp_entry_list *list, void *entry)
+{
+   struct list *node = ofp_entry_list_node (list, entry);
 
-   while (group_entry) {
-     next_group_entry = group_entry->list_node.next;
-     if ((group_entry->group_id == group_id) || (delete_all)) {
-        if (next_group_entry)
-           next_group_entry->list_node.prev = group_entry->list_node.prev;
-        if (prev_group_entry) 
-          prev_group_entry->list_node.next = group_entry->list_node.next;
-        ofp_delete_group (group_entry);
-        free (group_entry);
-     }
-     prev_group_entry = group_entry;
-     group_entry = group_entry->list_node.next;
-   }
-   return 0;
+   node->next = NULL;
+   node->prev = list->last;
+   if (list->last)
+      list->last->next = node;
+   else
+      list->first = node;
+   list->last = node;
 }
 
-uint8_t
-process_group_add_modify_mod_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+static void
+ofp_entry_list_remove (struct ofp_entry_list *list, void *entry)
 {
-   uint16_t i,j;
-   uint16_t no_of_bucket = 0;
-   uint16_t no_of_actions = 0;
-   struct openflow_group_entry *group_entry = NULL;
-   bool delete_all = FALSE;
-   uint32_t group_id;
+   struct list *node = ofp_entry_list_node (list, entry);
 
-   group_id = ntohl (group_modify_msg->group_id); 
+   if (node->prev)
+      node->prev->next = node->next;
+   else
+      list->first = node->next;
+   if (node->next)
+      node->next->prev = node->prev;
+   else
+      list->last = node->prev;
+}
 
-   if (!IS_GROUP_ALREADY_EXISTS(group_id)) {
-     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_UNKNOWN_GROUP);
-     return  0;
-   }
+/* O(1) lookup of a group in the group_id index */
+struct openflow_group_entry *
+ofp_group_find (struct openflow_group_table *group_table, uint32_t group_id)
+{
+   return group_table ? ofp_id_index_find (&group_table->index, group_id) : NULL;
+}
 
-   group_entry = ofp_switch.group_table->group_entry;
-   while (group_entry) {
-     if (group_entry->group_id == group_id) {
-        ofp_delete_group (group_entry);
-        process_group_modify_add_message (connection, xid, group_modify_msg);
-     }
-     else {
-        group_entry = group_entry->list_node.next;
-     }
-   }
-   return 0;
+/* O(1) lookup of a meter: small meter_ids are a direct array access,
+ * the others go through the hashed index */
+struct openflow_meter_entry *
+ofp_meter_find (struct openflow_meter_table *meter_table, uint32_t meter_id)
+{
+   if (!meter_table)
+      return NULL;
+   if (meter_id < OFP_METER_DENSE_MAX)
+      return meter_table->dense[meter_id];
+   return ofp_id_index_find (&meter_table->index, meter_id);
 }
 
-uint8_t
-process_group_modify_message (struct ofp_conn *connection, char *buf)
+/* Where each OpenFlow basic OXM field lives in struct ofp_flow_key.
+ * Fields with a zero size are not supported by the flow tables. */
+struct ofp_oxm_field_map {
+   uint16_t offset;
+   uint8_t size;
+};
+
+#define OFP_FLOW_KEY_FIELD(FIELD) \
+   { offsetof(struct ofp_flow_key, FIELD), sizeof(((struct ofp_flow_key *) 0)->FIELD) }
+
+static const struct ofp_oxm_field_map ofp_oxm_field_map[OFPXMT_OFB_PBB_UCA + 1] = {
+   [OFPXMT_OFB_IN_PORT] = OFP_FLOW_KEY_FIELD(in_port),
+   [OFPXMT_OFB_IN_PHY_PORT] = OFP_FLOW_KEY_FIELD(in_phy_port),
+   [OFPXMT_OFB_METADATA] = OFP_FLOW_KEY_FIELD(metadata),
+   [OFPXMT_OFB_ETH_DST] = OFP_FLOW_KEY_FIELD(eth_dst),
+   [OFPXMT_OFB_ETH_SRC] = OFP_FLOW_KEY_FIELD(eth_src),
+   [OFPXMT_OFB_ETH_TYPE] = OFP_FLOW_KEY_FIELD(eth_type),
+   [OFPXMT_OFB_VLAN_VID] = OFP_FLOW_KEY_FIELD(vlan_vid),
+   [OFPXMT_OFB_VLAN_PCP] = OFP_FLOW_KEY_FIELD(vlan_pcp),
+   [OFPXMT_OFB_IP_DSCP] = OFP_FLOW_KEY_FIELD(ip_dscp),
+   [OFPXMT_OFB_IP_ECN] = OFP_FLOW_KEY_FIELD(ip_ecn),
+   [OFPXMT_OFB_IP_PROTO] = OFP_FLOW_KEY_FIELD(ip_proto),
+   [OFPXMT_OFB_IPV4_SRC] = OFP_FLOW_KEY_FIELD(ipv4_src),
+   [OFPXMT_OFB_IPV4_DST] = OFP_FLOW_KEY_FIELD(ipv4_dst),
+   [OFPXMT_OFB_TCP_SRC] = OFP_FLOW_KEY_FIELD(tp_src),
+   [OFPXMT_OFB_TCP_DST] = OFP_FLOW_KEY_FIELD(tp_dst),
+   [OFPXMT_OFB_UDP_SRC] = OFP_FLOW_KEY_FIELD(tp_src),
+   [OFPXMT_OFB_UDP_DST] = OFP_FLOW_KEY_FIELD(tp_dst),
+   [OFPXMT_OFB_SCTP_SRC] = OFP_FLOW_KEY_FIELD(tp_src),
+   [OFPXMT_OFB_SCTP_DST] = OFP_FLOW_KEY_FIELD(tp_dst),
+   [OFPXMT_OFB_ICMPV4_TYPE] = OFP_FLOW_KEY_FIELD(icmp_type),
+   [OFPXMT_OFB_ICMPV4_CODE] = OFP_FLOW_KEY_FIELD(icmp_code),
+   [OFPXMT_OFB_ARP_OP] = OFP_FLOW_KEY_FIELD(arp_op),
+   [OFPXMT_OFB_ARP_SPA] = OFP_FLOW_KEY_FIELD(arp_spa),
+   [OFPXMT_OFB_ARP_TPA] = OFP_FLOW_KEY_FIELD(arp_tpa),
+   [OFPXMT_OFB_MPLS_LABEL] = OFP_FLOW_KEY_FIELD(mpls_label),
+   [OFPXMT_OFB_MPLS_TC] = OFP_FLOW_KEY_FIELD(mpls_tc),
+};
+
+/* Normalize the OXM TLVs of an ofp_match of 'match_len' bytes (as in
+ * ofp_match.length, so without the trailing padding) into 'match'. */
+uint32_t
+ofp_flow_match_from_ofp (struct ofp_match *ofp_match, uint16_t match_len,
+                         struct ofp_flow_match *match)
 {
-   struct ofp_group_mod *group_modify_msg = (struct ofp_group_mod *) (buf);
-   uint8_t command = ntohs(group_modify_msg->command);
-   uint32_t xid = htonl(0);
+   uint8_t *oxm = (uint8_t *) ofp_match + 4;
+   uint8_t *end = (uint8_t *) ofp_match + match_len;
+   const struct ofp_oxm_field_map *field;
+   uint8_t *key, *mask, *value, *value_mask;
+   uint32_t oxm_header;
+   uint8_t i;
 
-   if (command == OFPGC_ADD)
-     return process_group_modify_add_message (connection, xid, group_modify_msg);
-   else if (command == OFPGC_MODIFY)
-     return process_group_add_modify_mod_message (connection, xid, group_modify_msg);
-   else if (command == OFPGC_DELETE)
-     return process_group_add_modify_del_message (connection, xid, group_modify_msg);
-   else
-     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_INVALID_GROUP);
+   memset(match,0,sizeof(struct ofp_flow_match));
+   if (ntohs (ofp_match->type) != OFPMT_OXM)
+      return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_BAD_TYPE);
+
+   while (oxm < end) {
+      if (end - oxm < 4)
+         return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_BAD_LEN);
+      memcpy(&oxm_header, oxm, sizeof(uint32_t));
+      oxm_header = ntohl (oxm_header);
+      if (end - oxm - 4 < OXM_LENGTH(oxm_header))
+         return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_BAD_LEN);
+      if (OXM_CLASS(oxm_header) != OFPXMC_OPENFLOW_BASIC ||
+          OXM_FIELD(oxm_header) > OFPXMT_OFB_PBB_UCA ||
+          !ofp_oxm_field_map[OXM_FIELD(oxm_header)].size)
+         return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_BAD_FIELD);
 
+      field = &ofp_oxm_field_map[OXM_FIELD(oxm_header)];
+      if (OXM_LENGTH(oxm_header) != 
+          (OXM_HASMASK(oxm_header) ? 2 * field->size : field->size))
+         return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_BAD_LEN);
+
+      key = (uint8_t *) &match->key + field->offset;
+      mask = (uint8_t *) &match->mask + field->offset;
+      value = oxm + 4;
+      value_mask = OXM_HASMASK(oxm_header) ? value + field->size : NULL;
+      for (i=0;i<field->size;i++) {
+         if (mask[i])
+            return OFP_ERROR(OFPET_BAD_MATCH, OFPBMC_DUP_FIELD);
+      }
+      for (i=0;i<field->size;i++) {
+         mask[i] = value_mask ? value_mask[i] : 0xff;
+         key[i] = value[i] & mask[i];
+      }
+      oxm += 4 + OXM_LENGTH(oxm_header);
+   }
    return 0;
 }
-   
-uint8_t
-process_meter_modify_add_message (struct ofp_conn *connection, uint32_t xid, struct ofp_meter_mod *meter_modify_msg)
+
+static inline void
+ofp_flow_key_and (struct ofp_flow_key *dst, const struct ofp_flow_key *key,
+                  const struct ofp_flow_key *mask)
 {
-   uint16_t flag = 0;
-   uint16_t i,j;
-   uint16_t no_of_bands = 0;
-   struct openflow_meter_entry *meter_entry = NULL;
-   struct openflow_meter_entry *tmp_meter_entry = NULL;
-   struct openflow_meter_entry *position_to_insert = NULL;
-   struct ofp_switch_meter_band *bands = NULL;
-   struct ofp_switch_meter_band *prev_band = NULL;
-   struct ofp_meter_band_header *msg_band = NULL;
-   uint32_t meter_id = ntohl(meter_modify_msg->meter_id);
+   const uint64_t *k = (const uint64_t *) key;
+   const uint64_t *m = (const uint64_t *) mask;
+   uint64_t *d = (uint64_t *) dst;
+   uint32_t i;
+
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++)
+      d[i] = k[i] & m[i];
+}
+
+static inline bool
+ofp_flow_key_equal (const struct ofp_flow_key *a, const struct ofp_flow_key *b)
+{
+   return memcmp (a, b, sizeof(struct ofp_flow_key)) == 0;
+}
+
+/* TRUE if every flow matched by 'entry' is also matched by 'match',
+ * the selection rule of the non-strict flow_mod commands */
+static bool
+ofp_flow_match_covers (const struct ofp_flow_match *match,
+                       const struct ofp_flow_match *entry)
+{
+   const uint64_t *mk = (const uint64_t *) &match->key;
+   const uint64_t *mm = (const uint64_t *) &match->mask;
+   const uint64_t *ek = (const uint64_t *) &entry->key;
+   const uint64_t *em = (const uint64_t *) &entry->mask;
+   uint32_t i;
+
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++) {
+      if ((mm[i] & ~em[i]) || ((ek[i] & mm[i]) != mk[i]))
+         return FALSE;
+   }
+   return TRUE;
+}
+
+/* TRUE if some packet can match both */
+static bool
+ofp_flow_match_overlaps (const struct ofp_flow_match *a,
+                         const struct ofp_flow_match *b)
+{
+   const uint64_t *ak = (const uint64_t *) &a->key;
+   const uint64_t *am = (const uint64_t *) &a->mask;
+   const uint64_t *bk = (const uint64_t *) &b->key;
+   const uint64_t *bm = (const uint64_t *) &b->mask;
+   uint32_t i;
+
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++) {
+      if ((ak[i] ^ bk[i]) & am[i] & bm[i])
+         return FALSE;
+   }
+   return TRUE;
+}
+
+static bool
+ofp_flow_hmap_resize (struct ofp_flow_hmap *map, uint32_t n_buckets)
+{
+   struct openflow_entry **buckets;
+   struct openflow_entry *entry, *next;
+   uint32_t i;
+
+   buckets = calloc (n_buckets, sizeof(struct openflow_entry *));
+   if (!buckets)
+      return FALSE; /* keep the old, longer chains */
+   for (i=0;map->buckets && i<=map->mask;i++) {
+      for (entry = map->buckets[i]; entry; entry = next) {
+         next = entry->hash_next;
+         entry->hash_next = buckets[entry->hash & (n_buckets - 1)];
+         buckets[entry->hash & (n_buckets - 1)] = entry;
+      }
+   }
+   free (map->buckets);
+   map->buckets = buckets;
+   map->mask = n_buckets - 1;
+   return TRUE;
+}
+
+static void
+ofp_flow_hmap_insert (struct ofp_flow_hmap *map, struct openflow_entry *entry)
+{
+   struct openflow_entry **bucket;
+
+   if (map->n > map->mask)
+      ofp_flow_hmap_resize (map, (map->mask + 1) * 2);
+   bucket = &map->buckets[entry->hash & map->mask];
+   entry->hash_next = *bucket;
+   *bucket = entry;
+   map->n++;
+}
+
+static void
+ofp_flow_hmap_remove (struct ofp_flow_hmap *map, struct openflow_entry *entry)
+{
+   struct openflow_entry **prev = &map->buckets[entry->hash & map->mask];
+
+   while (*prev != entry)
+      prev = &(*prev)->hash_next;
+   *prev = entry->hash_next;
+   map->n--;
+}
+
+/* Hash of the words of 'key' selected by the subtable mask. 'key' does
+ * not need to be masked, so packets are hashed without a copy. */
+static inline uint32_t
+ofp_flow_subtable_hash (const struct ofp_flow_subtable *subtable,
+                        const struct ofp_flow_key *key)
+{
+   const uint64_t *k = (const uint64_t *) key;
+   const uint64_t *m = (const uint64_t *) &subtable->mask;
+   uint64_t hash = 0;
+   uint8_t i;
+
+   for (i=0;i<subtable->n_words;i++)
+      hash = ofp_hash_add64 (hash, k[subtable->words[i]] & m[subtable->words[i]]);
+   return ofp_hash_finish (hash);
+}
+
+/* TRUE if 'key' masked by the subtable mask is the key of 'entry' */
+static inline bool
+ofp_flow_subtable_match (const struct ofp_flow_subtable *subtable,
+                         const struct openflow_entry *entry,
+                         const struct ofp_flow_key *key)
+{
+   const uint64_t *k = (const uint64_t *) key;
+   const uint64_t *m = (const uint64_t *) &subtable->mask;
+   const uint64_t *e = (const uint64_t *) &entry->flow_match.key;
+   uint8_t i, w;
+
+   for (i=0;i<subtable->n_words;i++) {
+      w = subtable->words[i];
+      if ((k[w] & m[w]) != e[w])
+         return FALSE;
+   }
+   return TRUE;
+}
+
+static uint32_t
+ofp_flow_mask_hash (const struct ofp_flow_key *mask)
+{
+   const uint64_t *m = (const uint64_t *) mask;
+   uint64_t hash = 0;
+   uint32_t i;
+
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++)
+      hash = ofp_hash_add64 (hash, m[i]);
+   return ofp_hash_finish (hash);
+}
+
+static struct ofp_flow_subtable *
+ofp_flow_subtable_find (struct openflow_table *table, const struct ofp_flow_key *mask,
+                        uint32_t mask_hash, uint32_t *index)
+{
+   uint32_t i;
+
+   for (i=0;i<table->n_subtables;i++) {
+      if (table->subtables[i]->mask_hash == mask_hash &&
+          ofp_flow_key_equal (&table->subtables[i]->mask, mask)) {
+         if (index)
+            *index = i;
+         return table->subtables[i];
+      }
+   }
+   return NULL;
+}
+
+/* Move the subtable at 'index' to its place in the max_priority order
+ * after its max_priority changed */
+static void
+ofp_flow_subtable_reorder (struct openflow_table *table, uint32_t index)
+{
+   struct ofp_flow_subtable *subtable = table->subtables[index];
+
+   while (index > 0 &&
+          table->subtables[index - 1]->max_priority < subtable->max_priority) {
+      table->subtables[index] = table->subtables[index - 1];
+      index--;
+   }
+   while (index + 1 < table->n_subtables &&
+          table->subtables[index + 1]->max_priority > subtable->max_priority) {
+      table->subtables[index] = table->subtables[index + 1];
+      index++;
+   }
+   table->subtables[index] = subtable;
+}
+
+static struct ofp_flow_subtable *
+ofp_flow_subtable_create (struct openflow_table *table, const struct ofp_flow_key *mask,
+                          uint32_t mask_hash, uint32_t *index)
+{
+   const uint64_t *m = (const uint64_t *) mask;
+   struct ofp_flow_subtable **subtables, *subtable;
+   uint32_t i;
+
+   if (table->n_subtables == table->max_subtables) {
+      uint32_t max_subtables = table->max_subtables ? table->max_subtables * 2 : 8;
+      subtables = realloc (table->subtables,
+                           max_subtables * sizeof(struct ofp_flow_subtable *));
+      if (!subtables)
+         return NULL;
+      table->subtables = subtables;
+      table->max_subtables = max_subtables;
+   }
+   subtable = malloc (sizeof(struct ofp_flow_subtable));
+   if (!subtable)
+      return NULL;
+   memset(subtable,0,sizeof(struct ofp_flow_subtable));
+   if (!ofp_flow_hmap_resize (&subtable->flows, 16)) {
+      free (subtable);
+      return NULL;
+   }
+   subtable->mask = *mask;
+   subtable->mask_hash = mask_hash;
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++) {
+      if (m[i])
+         subtable->words[subtable->n_words++] = i;
+   }
+   /* An empty subtable has the lowest priority, it moves up on insert */
+   *index = table->n_subtables;
+   table->subtables[table->n_subtables++] = subtable;
+   return subtable;
+}
+
+static void
+ofp_flow_subtable_destroy (struct openflow_table *table, uint32_t index)
+{
+   struct ofp_flow_subtable *subtable = table->subtables[index];
+
+   memmove (&table->subtables[index], &table->subtables[index + 1],
+            (table->n_subtables - index - 1) * sizeof(struct ofp_flow_subtable *));
+   table->n_subtables--;
+   free (subtable->flows.buckets);
+   free (subtable);
+}
+
+/* Recount max_priority after the last flow at that priority went away */
+static void
+ofp_flow_subtable_rescan (struct ofp_flow_subtable *subtable)
+{
+   struct openflow_entry *entry;
+   uint32_t i;
+
+   subtable->max_priority = 0;
+   subtable->max_count = 0;
+   for (i=0;i<=subtable->flows.mask;i++) {
+      for (entry = subtable->flows.buckets[i]; entry; entry = entry->hash_next) {
+         if (entry->priority > subtable->max_priority || !subtable->max_count) {
+            subtable->max_priority = entry->priority;
+            subtable->max_count = 1;
+         }
+         else if (entry->priority == subtable->max_priority) {
+            subtable->max_count++;
+         }
+      }
+   }
+}
+
+void
+ofp_flow_table_init (struct openflow_table *table, uint8_t table_id)
+{
+   memset(table,0,sizeof(struct openflow_table));
+   table->table_id = table_id;
+   table->max_flows = OFP_FLOW_TABLE_MAX_ENTRIES;
+   table->vacancy = 100;
+   table->vacancy_next = OFPTR_VACANCY_DOWN;
+}
+
+/* Allocate and initialize the flow tables of the switch */
+uint8_t
+ofp_switch_tables_init (uint8_t n_tables)
+{
+   uint8_t i;
+
+   ofp_switch.features.tables = malloc (n_tables * sizeof(struct openflow_table));
+   if (!ofp_switch.features.tables)
+      return 1;
+   for (i=0;i<n_tables;i++)
+      ofp_flow_table_init (&ofp_switch.features.tables[i], i);
+   ofp_switch.features.n_tables = n_tables;
+   ofp_switch_config_changed ();
+   return 0;
+}
+
+static struct ofp_microflow_cache ofp_microflow_cache;
+
+/* Drop every cached microflow, called whenever a flow is added to or
+ * removed from a table since either can change what a packet matches */
+static inline void
+ofp_microflow_invalidate (void)
+{
+   ofp_microflow_cache.stats.n_invalidations++;
+   if (++ofp_microflow_cache.generation == 0 && ofp_microflow_cache.sets) {
+      /* wrapped: entries from 2^32 bumps ago would look valid again */
+      memset(ofp_microflow_cache.sets,0,
+             OFP_MICROFLOW_SETS * sizeof(struct ofp_microflow_set));
+      ofp_microflow_cache.generation = 1;
+   }
+}
+
+static inline uint32_t
+ofp_microflow_hash (const struct ofp_flow_key *key, uint8_t table_id)
+{
+   const uint64_t *k = (const uint64_t *) key;
+   uint64_t hash = table_id;
+   uint32_t i;
+
+   for (i=0;i<OFP_FLOW_KEY_WORDS;i++)
+      hash = ofp_hash_add64 (hash, k[i]);
+   return ofp_hash_finish (hash);
+}
+
+/* The entry with exactly this match and priority, in O(1) */
+struct openflow_entry *
+ofp_flow_table_find_strict (struct openflow_table *table,
+                            const struct ofp_flow_match *match, uint16_t priority)
+{
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry *entry;
+   uint32_t hash;
+
+   subtable = ofp_flow_subtable_find (table, &match->mask,
+                                      ofp_flow_mask_hash (&match->mask), NULL);
+   if (!subtable)
+      return NULL;
+   hash = ofp_flow_subtable_hash (subtable, &match->key);
+   for (entry = subtable->flows.buckets[hash & subtable->flows.mask]; entry;
+        entry = entry->hash_next) {
+      if (entry->hash == hash && entry->priority == priority &&
+          ofp_flow_key_equal (&entry->flow_match.key, &match->key))
+         return entry;
+   }
+   return NULL;
+}
+
+/* Eviction order of a flow under the OFPTMPEF_* flags of its table:
+ * importance first, then the hard timeout deadline (flows without one
+ * last), otherwise the oldest flow goes first. The key is only computed
+ * when the flow or the flags change, so the heap stays consistent. */
+static uint64_t
+ofp_flow_evict_key (struct openflow_table *table, struct openflow_entry *entry)
+{
+   uint64_t key = 0, order;
+
+   if (table->eviction_flag & OFPTMPEF_IMPORTANCE)
+      key = (uint64_t) entry->importance << 48;
+   if ((table->eviction_flag & OFPTMPEF_LIFETIME) && entry->hard_timeout)
+      order = entry->creation_time + entry->hard_timeout * 1000LL;
+   else if (table->eviction_flag & OFPTMPEF_LIFETIME)
+      order = (1ULL << 48) - 1;
+   else
+      order = entry->creation_time;
+   return key | (order & ((1ULL << 48) - 1));
+}
+
+static inline void
+ofp_flow_heap_set (struct openflow_table *table, uint32_t index, struct openflow_entry *entry)
+{
+   table->evict_heap[index] = entry;
+   entry->evict_index = index;
+}
+
+static void
+ofp_flow_heap_sift_up (struct openflow_table *table, uint32_t index)
+{
+   struct openflow_entry *entry = table->evict_heap[index];
+   uint32_t parent;
+
+   while (index > 0) {
+      parent = (index - 1) / 2;
+      if (table->evict_heap[parent]->evict_key <= entry->evict_key)
+         break;
+      ofp_flow_heap_set (table, index, table->evict_heap[parent]);
+      index = parent;
+   }
+   ofp_flow_heap_set (table, index, entry);
+}
+
+static void
+ofp_flow_heap_sift_down (struct openflow_table *table, uint32_t index)
+{
+   struct openflow_entry *entry = table->evict_heap[index];
+   uint32_t child;
+
+   while ((child = 2 * index + 1) < table->n_flows) {
+      if (child + 1 < table->n_flows &&
+          table->evict_heap[child + 1]->evict_key < table->evict_heap[child]->evict_key)
+         child++;
+      if (entry->evict_key <= table->evict_heap[child]->evict_key)
+         break;
+      ofp_flow_heap_set (table, index, table->evict_heap[child]);
+      index = child;
+   }
+   ofp_flow_heap_set (table, index, entry);
+}
+
+/* Recompute the eviction key of a flow whose importance or timeouts
+ * changed and restore the heap order, O(log n) */
+static void
+ofp_flow_evict_update (struct openflow_table *table, struct openflow_entry *entry)
+{
+   entry->evict_key = ofp_flow_evict_key (table, entry);
+   ofp_flow_heap_sift_up (table, entry->evict_index);
+   ofp_flow_heap_sift_down (table, entry->evict_index);
+}
+
+/* New OFPTMPEF_* flags: rekey every flow and rebuild the heap */
+static void
+ofp_flow_table_set_eviction (struct openflow_table *table, uint32_t flags)
+{
+   uint32_t i;
+
+   if (table->eviction_flag == flags)
+      return;
+   table->eviction_flag = flags;
+   for (i=0;i<table->n_flows;i++)
+      table->evict_heap[i]->evict_key = ofp_flow_evict_key (table, table->evict_heap[i]);
+   for (i=table->n_flows/2;i-->0;)
+      ofp_flow_heap_sift_down (table, i);
+}
+
+/* Current vacancy of a table, in percent of max_flows */
+static inline uint8_t
+ofp_flow_table_vacancy (struct openflow_table *table)
+{
+   return (uint64_t) (table->max_flows - table->n_flows) * 100 / table->max_flows;
+}
+
+/* Vacancy events, checked on every change of n_flows. A DOWN event is
+ * sent when the vacancy falls below vacancy_down and then nothing
+ * until it rises above vacancy_up, so a table hovering around one
+ * threshold does not flood the controllers. */
+static void
+ofp_flow_table_vacancy_check (struct openflow_table *table)
+{
+   uint64_t free_pct = (uint64_t) (table->max_flows - table->n_flows) * 100;
+   uint64_t subscribers;
+   uint16_t length;
+   uint8_t reason;
+   void *buf;
+
+   /* n_flows only exceeds max_flows while an added flow evicts another */
+   if (!(table->config_flag & OFPTC_VACANCY_EVENTS) ||
+       table->n_flows > table->max_flows)
+      return;
+   if (table->vacancy_next == OFPTR_VACANCY_DOWN &&
+       free_pct < (uint64_t) table->vacancy_down * table->max_flows)
+      reason = OFPTR_VACANCY_DOWN;
+   else if (table->vacancy_next == OFPTR_VACANCY_UP &&
+            free_pct > (uint64_t) table->vacancy_up * table->max_flows)
+      reason = OFPTR_VACANCY_UP;
+   else
+      return;
+
+   table->vacancy_next = (reason == OFPTR_VACANCY_DOWN) ? OFPTR_VACANCY_UP : OFPTR_VACANCY_DOWN;
+   table->vacancy = ofp_flow_table_vacancy (table);
+   subscribers = ofp_async_subscribers (OFP_ASYNC_TABLE_STATUS, reason);
+   if (subscribers && (buf = ofp_table_status_encode (table, reason, &length)))
+      ofp_async_publish (subscribers, OFPT_TABLE_STATUS, buf, length);
+}
+
+static uint32_t
+ofp_flow_table_insert (struct openflow_table *table, struct openflow_entry *entry)
+{
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry **heap;
+   uint32_t mask_hash, index;
+
+   if (table->n_flows == table->max_evict) {
+      uint32_t max_evict = table->max_evict ? table->max_evict * 2 : 64;
+      heap = realloc (table->evict_heap, max_evict * sizeof(struct openflow_entry *));
+      if (!heap)
+         return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+      table->evict_heap = heap;
+      table->max_evict = max_evict;
+   }
+
+   mask_hash = ofp_flow_mask_hash (&entry->flow_match.mask);
+   subtable = ofp_flow_subtable_find (table, &entry->flow_match.mask, mask_hash, &index);
+   if (!subtable)
+      subtable = ofp_flow_subtable_create (table, &entry->flow_match.mask, mask_hash, &index);
+   if (!subtable)
+      return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+
+   entry->hash = ofp_flow_subtable_hash (subtable, &entry->flow_match.key);
+   ofp_flow_hmap_insert (&subtable->flows, entry);
+   ofp_microflow_invalidate ();
+   subtable->n_flows++;
+   entry->evict_key = ofp_flow_evict_key (table, entry);
+   ofp_flow_heap_set (table, table->n_flows++, entry);
+   ofp_flow_heap_sift_up (table, entry->evict_index);
+   if (subtable->n_flows == 1 || entry->priority > subtable->max_priority) {
+      subtable->max_priority = entry->priority;
+      subtable->max_count = 1;
+      ofp_flow_subtable_reorder (table, index);
+   }
+   else if (entry->priority == subtable->max_priority) {
+      subtable->max_count++;
+   }
+   ofp_flow_table_vacancy_check (table);
+   return 0;
+}
+
+static void
+ofp_flow_table_remove (struct openflow_table *table, struct openflow_entry *entry)
+{
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry *moved;
+   uint32_t index;
+
+   subtable = ofp_flow_subtable_find (table, &entry->flow_match.mask,
+                                      ofp_flow_mask_hash (&entry->flow_match.mask), &index);
+   ofp_flow_hmap_remove (&subtable->flows, entry);
+   ofp_microflow_invalidate ();
+   subtable->n_flows--;
+   table->n_flows--;
+   if (entry->evict_index != table->n_flows) {
+      /* the last heap slot fills the hole */
+      moved = table->evict_heap[table->n_flows];
+      ofp_flow_heap_set (table, entry->evict_index, moved);
+      ofp_flow_heap_sift_up (table, moved->evict_index);
+      ofp_flow_heap_sift_down (table, moved->evict_index);
+   }
+   if (!subtable->n_flows) {
+      ofp_flow_subtable_destroy (table, index);
+   }
+   else if (entry->priority == subtable->max_priority && !--subtable->max_count) {
+      ofp_flow_subtable_rescan (subtable);
+      ofp_flow_subtable_reorder (table, index);
+   }
+   ofp_flow_table_vacancy_check (table);
+}
+
+/* Highest priority flow of the table matching the packet key. For the
+ * datapath: one hash probe per subtable, in max_priority order, until
+ * no subtable left can hold a better match. */
+struct openflow_entry *
+ofp_flow_table_lookup (struct openflow_table *table, const struct ofp_flow_key *pkt_key)
+{
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry *entry, *best = NULL;
+   uint32_t hash, i;
+
+   for (i=0;i<table->n_subtables;i++) {
+      subtable = table->subtables[i];
+      if (best && best->priority >= subtable->max_priority)
+         break;
+      hash = ofp_flow_subtable_hash (subtable, pkt_key);
+      for (entry = subtable->flows.buckets[hash & subtable->flows.mask]; entry;
+           entry = entry->hash_next) {
+         if (entry->hash == hash &&
+             (!best || entry->priority > best->priority) &&
+             ofp_flow_subtable_match (subtable, entry, pkt_key))
+            best = entry;
+      }
+   }
+   return best;
+}
+
+struct openflow_entry *
+ofp_flow_lookup (uint8_t table_id, const struct ofp_flow_key *pkt_key)
+{
+   if (table_id >= ofp_switch.features.n_tables)
+      return NULL;
+   return ofp_flow_table_lookup (&ofp_switch.features.tables[table_id], pkt_key);
+}
+
+/* ofp_flow_lookup() for the datapath fast path: exact packet keys hit
+ * the microflow cache, only misses go through the classifier */
+struct openflow_entry *
+ofp_flow_lookup_cached (uint8_t table_id, const struct ofp_flow_key *pkt_key)
+{
+   struct ofp_microflow_cache *cache = &ofp_microflow_cache;
+   struct ofp_microflow_entry *way, *slot = NULL;
+   struct ofp_microflow_set *set;
+   uint32_t hash, i;
+
+   if (!cache->sets) {
+      cache->sets = calloc (OFP_MICROFLOW_SETS, sizeof(struct ofp_microflow_set));
+      if (!cache->sets)
+         return ofp_flow_lookup (table_id, pkt_key);
+      cache->generation = 1;
+   }
+
+   hash = ofp_microflow_hash (pkt_key, table_id);
+   set = &cache->sets[hash & (OFP_MICROFLOW_SETS - 1)];
+   for (i=0;i<OFP_MICROFLOW_WAYS;i++) {
+      way = &set->ways[i];
+      if (way->generation != cache->generation) {
+         if (!slot)
+            slot = way;
+         continue;
+      }
+      if (way->hash == hash && way->table_id == table_id &&
+          ofp_flow_key_equal (&way->key, pkt_key)) {
+         cache->stats.n_hits++;
+         return way->flow;
+      }
+   }
+
+   cache->stats.n_misses++;
+   if (!slot) {
+      slot = &set->ways[set->victim];
+      set->victim = (set->victim + 1) % OFP_MICROFLOW_WAYS;
+      cache->stats.n_evictions++;
+   }
+   slot->key = *pkt_key;
+   slot->hash = hash;
+   slot->table_id = table_id;
+   slot->flow = ofp_flow_lookup (table_id, pkt_key);
+   slot->generation = cache->generation;
+   return slot->flow;
+}
+
+const struct ofp_microflow_stats *
+ofp_microflow_cache_stats (void)
+{
+   return &ofp_microflow_cache.stats;
+}
+
+/* Flows selected by a non-strict flow_mod. They are gathered first
+ * because removing flows reorders and frees subtables. Subtables whose
+ * mask does not cover the match mask can't hold a selected flow. */
+static struct {
+   struct openflow_entry **entries;
+   uint32_t n;
+   uint32_t max;
+} ofp_flow_selection;
+
+static uint32_t
+ofp_flow_table_select (struct openflow_table *table, const struct ofp_flow_match *match)
+{
+   const uint64_t *mm = (const uint64_t *) &match->mask;
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry *entry, **entries;
+   uint32_t i, j, w;
+
+   ofp_flow_selection.n = 0;
+   for (i=0;i<table->n_subtables;i++) {
+      subtable = table->subtables[i];
+      for (w=0;w<OFP_FLOW_KEY_WORDS;w++) {
+         if (mm[w] & ~((const uint64_t *) &subtable->mask)[w])
+            break;
+      }
+      if (w < OFP_FLOW_KEY_WORDS)
+         continue;
+      for (j=0;j<=subtable->flows.mask;j++) {
+         for (entry = subtable->flows.buckets[j]; entry; entry = entry->hash_next) {
+            if (!ofp_flow_match_covers (match, &entry->flow_match))
+               continue;
+            if (ofp_flow_selection.n == ofp_flow_selection.max) {
+               uint32_t max = ofp_flow_selection.max ? ofp_flow_selection.max * 2 : 64;
+               entries = realloc (ofp_flow_selection.entries,
+                                  max * sizeof(struct openflow_entry *));
+               if (!entries)
+                  return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+               ofp_flow_selection.entries = entries;
+               ofp_flow_selection.max = max;
+            }
+            ofp_flow_selection.entries[ofp_flow_selection.n++] = entry;
+         }
+      }
+   }
+   return 0;
+}
+
+/* Check that an action list is well formed, so the datapath can walk
+ * it without bounds checks */
+static uint32_t
+ofp_actions_validate (char *actions, uint16_t len)
+{
+   struct ofp_action_header *action;
+   uint16_t act_len, offset;
+
+   for (offset = 0; offset < len; offset += act_len) {
+      if (offset + sizeof(struct ofp_action_header) > len)
+         return OFP_ERROR(OFPET_BAD_ACTION, OFPBAC_BAD_LEN);
+      action = (struct ofp_action_header *) (actions + offset);
+      act_len = ntohs (action->len);
+      if (act_len < sizeof(struct ofp_action_header) || act_len % 8 ||
+          act_len > (uint16_t) (len - offset))
+         return OFP_ERROR(OFPET_BAD_ACTION, OFPBAC_BAD_LEN);
+   }
+   return 0;
+}
+
+/* Same for an instruction list and the action lists inside it */
+static uint32_t
+ofp_instructions_validate (char *instructions, uint16_t len)
+{
+   struct ofp_instruction_header *inst;
+   uint16_t inst_len, offset;
+   uint32_t error;
+
+   for (offset = 0; offset < len; offset += inst_len) {
+      if (offset + sizeof(struct ofp_instruction_header) > len)
+         return OFP_ERROR(OFPET_BAD_INSTRUCTION, OFPBIC_BAD_LEN);
+      inst = (struct ofp_instruction_header *) (instructions + offset);
+      inst_len = ntohs (inst->len);
+      if (inst_len < sizeof(struct ofp_instruction_header) || inst_len % 8 ||
+          inst_len > (uint16_t) (len - offset))
+         return OFP_ERROR(OFPET_BAD_INSTRUCTION, OFPBIC_BAD_LEN);
+      if (ntohs (inst->type) != OFPIT_APPLY_ACTIONS &&
+          ntohs (inst->type) != OFPIT_WRITE_ACTIONS)
+         continue;
+      if (inst_len < sizeof(struct ofp_instruction_actions))
+         return OFP_ERROR(OFPET_BAD_INSTRUCTION, OFPBIC_BAD_LEN);
+      error = ofp_actions_validate ((char *) inst + sizeof(struct ofp_instruction_actions),
+                                    inst_len - sizeof(struct ofp_instruction_actions));
+      if (error)
+         return error;
+   }
+   return 0;
+}
+
+/* Next group action of a validated action list, from '*offset' on.
+ * Returns FALSE when there is none left. */
+static bool
+ofp_actions_next_group (const char *actions, uint16_t len, uint16_t *offset,
+                        uint32_t *group_id)
+{
+   const struct ofp_action_header *action;
+
+   while (*offset < len) {
+      action = (const struct ofp_action_header *) (actions + *offset);
+      *offset += ntohs (action->len);
+      if (ntohs (action->type) == OFPAT_GROUP) {
+         *group_id = ntohl (((const struct ofp_action_group *) action)->group_id);
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+/* Call 'cb' for every action of the apply and write actions
+ * instructions of a validated instruction list */
+static void
+ofp_flow_for_each_action (char *instructions, uint16_t len,
+                          void (*cb) (struct ofp_action_header *action, void *aux),
+                          void *aux)
+{
+   struct ofp_instruction_header *inst;
+   uint16_t offset, act_offset;
+
+   for (offset = 0; offset < len; offset += ntohs (inst->len)) {
+      inst = (struct ofp_instruction_header *) (instructions + offset);
+      if (ntohs (inst->type) != OFPIT_APPLY_ACTIONS &&
+          ntohs (inst->type) != OFPIT_WRITE_ACTIONS)
+         continue;
+      for (act_offset = sizeof(struct ofp_instruction_actions);
+           act_offset < ntohs (inst->len);
+           act_offset += ntohs (((struct ofp_action_header *) ((char *) inst + act_offset))->len))
+         cb ((struct ofp_action_header *) ((char *) inst + act_offset), aux);
+   }
+}
+
+/* out_port / out_group filter of the flow_mod delete commands */
+struct ofp_flow_output_filter {
+   uint32_t out_port;
+   uint32_t out_group;
+   bool port_found;
+   bool group_found;
+};
+
+static void
+ofp_flow_output_filter_cb (struct ofp_action_header *action, void *aux)
+{
+   struct ofp_flow_output_filter *filter = aux;
+   uint16_t type = ntohs (action->type);
+   uint32_t port, group_id;
+
+   if (type == (uint16_t) OFPAT_OUTPUT) {
+      port = ntohl (((struct ofp_action_output *) action)->port);
+      if (port == filter->out_port)
+         filter->port_found = TRUE;
+   }
+   else if (type == (uint16_t) OFPAT_GROUP) {
+      group_id = ntohl (((struct ofp_action_group *) action)->group_id);
+      if (group_id == filter->out_group)
+         filter->group_found = TRUE;
+   }
+}
+
+static bool
+ofp_flow_has_output (struct openflow_entry *entry, uint32_t out_port, uint32_t out_group)
+{
+   struct ofp_flow_output_filter filter;
+
+   if (out_port == OFPP_ANY && out_group == OFPG_ANY)
+      return TRUE;
+   filter.out_port = out_port;
+   filter.out_group = out_group;
+   filter.port_found = (out_port == OFPP_ANY);
+   filter.group_found = (out_group == OFPG_ANY);
+   ofp_flow_for_each_action ((char *) entry->instructions, entry->instructions_len,
+                             ofp_flow_output_filter_cb, &filter);
+   return filter.port_found && filter.group_found;
+}
+
+static struct ofp_timer_wheel ofp_flow_timers;
+
+static void
+ofp_timer_link (struct ofp_timer_wheel *wheel, struct ofp_timer *timer)
+{
+   uint64_t expires = timer->expires;
+   uint64_t delta;
+   struct ofp_timer **slot;
+   uint32_t level;
+
+   if (expires <= wheel->now)
+      expires = wheel->now + 1;
+   delta = expires - wheel->now;
+   for (level=0;level<OFP_TIMER_WHEEL_LEVELS-1;level++) {
+      if (delta < (1ULL << (OFP_TIMER_WHEEL_BITS * (level + 1))))
+         break;
+   }
+   if (level == OFP_TIMER_WHEEL_LEVELS - 1 &&
+       delta >= (1ULL << (OFP_TIMER_WHEEL_BITS * OFP_TIMER_WHEEL_LEVELS)))
+      expires = wheel->now + (1ULL << (OFP_TIMER_WHEEL_BITS * OFP_TIMER_WHEEL_LEVELS)) - 1;
+
+   slot = &wheel->slots[level][(expires >> (OFP_TIMER_WHEEL_BITS * level)) & OFP_TIMER_WHEEL_MASK];
+   timer->next = *slot;
+   if (*slot)
+      (*slot)->pprev = &timer->next;
+   *slot = timer;
+   timer->pprev = slot;
+}
+
+/* Schedule 'timer' for tick 'expires', O(1) */
+void
+ofp_timer_add (struct ofp_timer_wheel *wheel, struct ofp_timer *timer, uint64_t expires)
+{
+   timer->expires = expires;
+   ofp_timer_link (wheel, timer);
+   wheel->n_timers++;
+}
+
+void
+ofp_timer_del (struct ofp_timer_wheel *wheel, struct ofp_timer *timer)
+{
+   if (!timer->pprev)
+      return;
+   *timer->pprev = timer->next;
+   if (timer->next)
+      timer->next->pprev = timer->pprev;
+   timer->pprev = NULL;
+   wheel->n_timers--;
+}
+
+/* Move the timers of a slot down to the levels below. Those due on
+ * this very tick go straight to 'expired': linking them again would
+ * put them one tick late. */
+static void
+ofp_timer_cascade (struct ofp_timer_wheel *wheel, uint32_t level, uint32_t index,
+                   struct ofp_timer **expired)
+{
+   struct ofp_timer *timer, *next;
+
+   timer = wheel->slots[level][index];
+   wheel->slots[level][index] = NULL;
+   for (; timer; timer = next) {
+      next = timer->next;
+      if (timer->expires <= wheel->now) {
+         timer->pprev = NULL;
+         timer->next = *expired;
+         *expired = timer;
+         wheel->n_timers--;
+      }
+      else
+         ofp_timer_link (wheel, timer);
+   }
+}
+
+/* Run the wheel up to tick 'now' and return the expired timers, linked
+ * through their next pointer and no longer scheduled */
+struct ofp_timer *
+ofp_timer_wheel_advance (struct ofp_timer_wheel *wheel, uint64_t now)
+{
+   struct ofp_timer *expired = NULL, *timer, *next;
+   uint32_t level, index;
+
+   if (!wheel->n_timers) {
+      wheel->now = now;
+      return NULL;
+   }
+   while (wheel->now < now) {
+      wheel->now++;
+      for (level=0;level<OFP_TIMER_WHEEL_LEVELS-1;level++) {
+         if ((wheel->now >> (OFP_TIMER_WHEEL_BITS * level)) & OFP_TIMER_WHEEL_MASK)
+            break;
+         ofp_timer_cascade (wheel, level + 1,
+                            (wheel->now >> (OFP_TIMER_WHEEL_BITS * (level + 1))) & OFP_TIMER_WHEEL_MASK,
+                            &expired);
+      }
+      index = wheel->now & OFP_TIMER_WHEEL_MASK;
+      for (timer = wheel->slots[0][index]; timer; timer = next) {
+         next = timer->next;
+         timer->pprev = NULL;
+         timer->next = expired;
+         expired = timer;
+         wheel->n_timers--;
+      }
+      wheel->slots[0][index] = NULL;
+      if (!wheel->n_timers) {
+         wheel->now = now;
+         break;
+      }
+   }
+   return expired;
+}
+
+static inline uint64_t
+ofp_timer_tick (long long int msec)
+{
+   return (msec + OFP_TIMER_TICK_MSEC - 1) / OFP_TIMER_TICK_MSEC;
+}
+
+/* Earliest of the hard and idle deadlines of a flow, in msec. The idle
+ * one moves with every hit, so it is only checked when the timer fires. */
+static long long int
+ofp_flow_deadline (struct openflow_entry *entry)
+{
+   long long int deadline = 0, idle;
+
+   if (entry->hard_timeout)
+      deadline = entry->creation_time + entry->hard_timeout * 1000LL;
+   if (entry->idle_timeout) {
+      idle = entry->last_used + entry->idle_timeout * 1000LL;
+      if (!deadline || idle < deadline)
+         deadline = idle;
+   }
+   return deadline;
+}
+
+static void
+ofp_flow_schedule (struct openflow_entry *entry)
+{
+   long long int deadline;
+
+   ofp_timer_del (&ofp_flow_timers, &entry->timer);
+   deadline = ofp_flow_deadline (entry);
+   if (!deadline)
+      return;
+   if (!ofp_flow_timers.n_timers)
+      ofp_flow_timers.now = time_msec () / OFP_TIMER_TICK_MSEC;
+   ofp_timer_add (&ofp_flow_timers, &entry->timer, ofp_timer_tick (deadline));
+}
+
+/* Account a packet hit on a flow, for the datapath. 'now' is the msec
+ * clock of the packet batch, read once per batch. */
+void
+ofp_flow_account (struct openflow_entry *entry, uint32_t n_bytes, long long int now)
+{
+   entry->packet_count++;
+   entry->byte_count += n_bytes;
+   entry->last_used = now;
+}
+
+/* Groups the group actions of a flow forward to. A first pass with no
+ * 'refs' only counts them. */
+struct ofp_flow_group_refs {
+   struct openflow_entry *entry;
+   struct ofp_group_ref *refs;
+   uint16_t n;
+   bool unknown;
+};
+
+static void
+ofp_flow_group_refs_cb (struct ofp_action_header *action, void *aux_)
+{
+   struct ofp_flow_group_refs *aux = aux_;
+   struct openflow_group_entry *group_entry;
+
+   if (ntohs (action->type) != OFPAT_GROUP)
+      return;
+   group_entry = ofp_group_find (ofp_switch.group_table,
+                                 ntohl (((struct ofp_action_group *) action)->group_id));
+   if (!group_entry) {
+      aux->unknown = TRUE;
+      return;
+   }
+   if (aux->refs) {
+      aux->refs[aux->n].flow = aux->entry;
+      aux->refs[aux->n].group = group_entry;
+   }
+   aux->n++;
+}
+
+/* Drop the references of a flow on its groups, O(1) each */
+static void
+ofp_flow_release_groups (struct openflow_entry *entry)
+{
+   struct ofp_group_ref *ref;
+   uint16_t i;
+
+   for (i=0;i<entry->n_group_refs;i++) {
+      ref = &entry->group_refs[i];
+      *ref->pprev = ref->next;
+      if (ref->next)
+         ref->next->pprev = ref->pprev;
+      ref->group->n_flow_refs--;
+   }
+   free (entry->group_refs);
+   entry->group_refs = NULL;
+   entry->n_group_refs = 0;
+}
+
+/* Meter of the meter instruction of a validated instruction list, or 0 */
+static uint32_t
+ofp_instructions_meter (char *instructions, uint16_t len)
+{
+   struct ofp_instruction_header *inst;
+   uint16_t offset;
+
+   for (offset = 0; offset < len; offset += ntohs (inst->len)) {
+      inst = (struct ofp_instruction_header *) (instructions + offset);
+      if (ntohs (inst->type) == OFPIT_METER)
+         return ntohl (((struct ofp_instruction_meter *) inst)->meter_id);
+   }
+   return 0;
+}
+
+static void
+ofp_flow_release_meter (struct openflow_entry *entry)
+{
+   struct openflow_meter_entry *meter_entry;
+
+   meter_entry = entry->meter_id ?
+                 ofp_meter_find (ofp_switch.meter_table, entry->meter_id) : NULL;
+   if (meter_entry)
+      meter_entry->flow_count--;
+   entry->meter_id = 0;
+}
+
+static void
+ofp_flow_entry_free (struct openflow_entry *entry)
+{
+   ofp_timer_del (&ofp_flow_timers, &entry->timer);
+   ofp_flow_release_groups (entry);
+   ofp_flow_release_meter (entry);
+   free (entry->instructions);
+   free (entry);
+}
+
+/* Replace the instructions of a flow with the ones of the flow_mod, and
+ * its group references with the ones of the new group actions */
+static uint32_t
+ofp_flow_set_instructions (struct openflow_entry *entry, char *instructions, uint16_t len)
+{
+   struct ofp_instruction_header *copy = NULL;
+   struct ofp_flow_group_refs aux;
+   struct openflow_meter_entry *meter_entry = NULL;
+   struct ofp_group_ref *ref;
+   uint32_t meter_id;
+   uint16_t i;
+
+   meter_id = ofp_instructions_meter (instructions, len);
+   if (meter_id) {
+      meter_entry = ofp_meter_find (ofp_switch.meter_table, meter_id);
+      if (!meter_entry)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_UNKNOWN_METER);
+   }
+   memset (&aux, 0, sizeof aux);
+   aux.entry = entry;
+   ofp_flow_for_each_action (instructions, len, ofp_flow_group_refs_cb, &aux);
+   if (aux.unknown)
+      return OFP_ERROR(OFPET_BAD_ACTION, OFPBAC_BAD_OUT_GROUP);
+   if (aux.n) {
+      aux.refs = calloc (aux.n, sizeof(struct ofp_group_ref));
+      if (!aux.refs)
+         return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+      aux.n = 0;
+      ofp_flow_for_each_action (instructions, len, ofp_flow_group_refs_cb, &aux);
+   }
+   if (len) {
+      copy = malloc (len);
+      if (!copy) {
+         free (aux.refs);
+         return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+      }
+      memcpy (copy, instructions, len);
+   }
+   free (entry->instructions);
+   entry->instructions = copy;
+   entry->instructions_len = len;
+
+   ofp_flow_release_groups (entry);
+   for (i=0;i<aux.n;i++) {
+      ref = &aux.refs[i];
+      ref->next = ref->group->flow_refs;
+      if (ref->next)
+         ref->next->pprev = &ref->next;
+      ref->pprev = &ref->group->flow_refs;
+      ref->group->flow_refs = ref;
+      ref->group->n_flow_refs++;
+   }
+   entry->group_refs = aux.refs;
+   entry->n_group_refs = aux.n;
+
+   ofp_flow_release_meter (entry);
+   if (meter_entry) {
+      meter_entry->flow_count++;
+      entry->meter_id = meter_id;
+   }
+   return 0;
+}
+
+/* Remove a flow from its table and free it, telling the controllers
+ * first if the flow asked for it */
+void
+ofp_flow_remove (struct openflow_table *table, struct openflow_entry *entry,
+                 enum ofp_flow_removed_reason reason)
+{
+   uint64_t subscribers = 0;
+   uint16_t length;
+   void *buf;
+
+   ofp_flow_table_remove (table, entry);
+   if (entry->flags & OFPFF_SEND_FLOW_REM)
+      subscribers = ofp_async_subscribers (OFP_ASYNC_FLOW_REMOVED, reason);
+   if (subscribers && (buf = ofp_flow_removed_encode (entry, reason, &length)))
+      ofp_async_publish (subscribers, OFPT_FLOW_REMOVED, buf, length);
+   ofp_flow_entry_free (entry);
+}
+
+/* Flows whose timer fired and which are really expired, removed in
+ * batches so that each controller connection gets all the flow-removed
+ * messages of a batch in as few writes as possible */
+struct ofp_flow_expiry {
+   uint32_t n;
+   struct openflow_entry *entries[OFP_FLOW_EXPIRE_BATCH];
+   uint8_t reasons[OFP_FLOW_EXPIRE_BATCH];
+};
+
+static void
+ofp_flow_expiry_flush (struct ofp_flow_expiry *expiry)
+{
+   struct ofp_conn *connection;
+   struct openflow_entry *entry;
+   uint64_t subscribers, all = 0;
+   uint16_t length;
+   uint32_t i;
+   void *buf;
+
+   for (i=0;i<expiry->n;i++) {
+      entry = expiry->entries[i];
+      ofp_flow_table_remove (&ofp_switch.features.tables[entry->table_id], entry);
+      if (entry->flags & OFPFF_SEND_FLOW_REM)
+         all |= ofp_async_subscribers (OFP_ASYNC_FLOW_REMOVED, expiry->reasons[i]);
+   }
+
+   /* Each message is encoded once and the connections write the whole
+    * batch at its end */
+   for (subscribers = all; subscribers; subscribers &= subscribers - 1) {
+      connection = ofp_reactor.registry.slots[__builtin_ctzll (subscribers)];
+      if (connection)
+         ofp_conn_batch_begin (connection);
+   }
+   for (i=0;all && i<expiry->n;i++) {
+      entry = expiry->entries[i];
+      subscribers = (entry->flags & OFPFF_SEND_FLOW_REM) ?
+                    ofp_async_subscribers (OFP_ASYNC_FLOW_REMOVED, expiry->reasons[i]) : 0;
+      if (subscribers && (buf = ofp_flow_removed_encode (entry, expiry->reasons[i], &length)))
+         ofp_async_publish (subscribers, OFPT_FLOW_REMOVED, buf, length);
+   }
+   for (subscribers = all; subscribers; subscribers &= subscribers - 1) {
+      connection = ofp_reactor.registry.slots[__builtin_ctzll (subscribers)];
+      if (connection && !connection->closing && ofp_conn_batch_end (connection)) {
+         connection->closing = TRUE;
+         ofp_reactor_activate (&ofp_reactor, connection);
+      }
+   }
+
+   for (i=0;i<expiry->n;i++)
+      ofp_flow_entry_free (expiry->entries[i]);
+   expiry->n = 0;
+}
+
+/* Expire the flows whose hard or idle timeout passed. Only the flows
+ * whose timer fired are looked at: a flow hit since it was scheduled
+ * is put back on the wheel at its new idle deadline. */
+void
+ofp_flow_timers_run (long long int now)
+{
+   struct ofp_flow_expiry expiry;
+   struct openflow_entry *entry;
+   struct ofp_timer *timer, *next;
+
+   expiry.n = 0;
+   timer = ofp_timer_wheel_advance (&ofp_flow_timers, now / OFP_TIMER_TICK_MSEC);
+   for (; timer; timer = next) {
+      next = timer->next;
+      entry = OFP_CONTAINER_OF(timer, struct openflow_entry, timer);
+      if (entry->hard_timeout &&
+          now >= entry->creation_time + entry->hard_timeout * 1000LL) {
+         expiry.reasons[expiry.n] = OFPRR_HARD_TIMEOUT;
+      }
+      else if (entry->idle_timeout &&
+               now >= entry->last_used + entry->idle_timeout * 1000LL) {
+         expiry.reasons[expiry.n] = OFPRR_IDLE_TIMEOUT;
+      }
+      else {
+         ofp_flow_schedule (entry);
+         continue;
+      }
+      expiry.entries[expiry.n++] = entry;
+      if (expiry.n == OFP_FLOW_EXPIRE_BATCH)
+         ofp_flow_expiry_flush (&expiry);
+   }
+   if (expiry.n)
+      ofp_flow_expiry_flush (&expiry);
+}
+
+/* Parsed flow_mod, shared by the add, modify and delete commands */
+struct ofp_flow_mod_args {
+   struct ofp_flow_mod *msg;
+   struct ofp_flow_match match;
+   char *instructions;
+   uint16_t instructions_len;
+   uint16_t priority;
+   uint16_t flags;
+   uint64_t cookie;
+   uint64_t cookie_mask;
+   uint32_t out_port;
+   uint32_t out_group;
+};
+
+/* Lowest ranked flow of the heap, other than the one just added */
+static struct openflow_entry *
+ofp_flow_evict_victim (struct openflow_table *table, struct openflow_entry *added)
+{
+   if (table->evict_heap[0] != added)
+      return table->evict_heap[0];
+   if (table->n_flows > 2 &&
+       table->evict_heap[2]->evict_key < table->evict_heap[1]->evict_key)
+      return table->evict_heap[2];
+   return table->evict_heap[1];
+}
+
+static uint32_t
+ofp_flow_add (struct openflow_table *table, struct ofp_flow_mod_args *args)
+{
+   struct ofp_flow_mod *flow_modify_msg = args->msg;
+   struct ofp_flow_subtable *subtable;
+   struct openflow_entry *flow_entry, *entry;
+   uint32_t error, i, j;
+
+   flow_entry = ofp_flow_table_find_strict (table, &args->match, args->priority);
+
+   if (!flow_entry && (args->flags & OFPFF_CHECK_OVERLAP)) {
+      /* Only asked for by the controller, so a walk of the table is fine */
+      for (i=0;i<table->n_subtables;i++) {
+         subtable = table->subtables[i];
+         if (subtable->max_priority < args->priority)
+            break;
+         for (j=0;j<=subtable->flows.mask;j++) {
+            for (entry = subtable->flows.buckets[j]; entry; entry = entry->hash_next) {
+               if (entry->priority == args->priority &&
+                   ofp_flow_match_overlaps (&entry->flow_match, &args->match))
+                  return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_OVERLAP);
+            }
+         }
+      }
+   }
+
+   if (!flow_entry && table->n_flows >= table->max_flows &&
+       (!(table->config_flag & OFPTC_EVICTION) || !table->n_flows))
+      return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_TABLE_FULL);
+
+   if (!flow_entry) {
+      flow_entry = malloc (sizeof (struct openflow_entry));
+      if (!flow_entry)
+         return OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_UNKNOWN);
+      memset(flow_entry,0,sizeof(struct openflow_entry));
+      flow_entry->table_id = table->table_id;
+      flow_entry->priority = args->priority;
+      flow_entry->flow_match = args->match;
+      memcpy(&flow_entry->match,&flow_modify_msg->match, sizeof(struct ofp_match)); 
+      error = ofp_flow_set_instructions (flow_entry, args->instructions, args->instructions_len);
+      if (!error)
+         error = ofp_flow_table_insert (table, flow_entry);
+      if (error) {
+         ofp_flow_entry_free (flow_entry);
+         return error;
+      }
+      /* Only a flow which was added makes room, by evicting the flow
+       * the OFPTMPEF_* flags rank lowest. Evicting after the insert
+       * means a failed insert never costs a live flow. */
+      if (table->n_flows > table->max_flows)
+         ofp_flow_remove (table, ofp_flow_evict_victim (table, flow_entry), OFPRR_EVICTION);
+   }
+   else {
+      /* Identical match and priority: the new flow replaces the old one */
+      error = ofp_flow_set_instructions (flow_entry, args->instructions, args->instructions_len);
+      if (error)
+         return error;
+      if (args->flags & OFPFF_RESET_COUNTS) {
+         flow_entry->packet_count = 0;
+         flow_entry->byte_count = 0;
+      }
+   }
+   flow_entry->cookie = args->cookie;
+   flow_entry->idle_timeout = ntohs (flow_modify_msg->idle_timeout);
+   flow_entry->hard_timeout = ntohs (flow_modify_msg->hard_timeout);
+   flow_entry->flags = args->flags;
+   flow_entry->importance = ntohs (flow_modify_msg->importance);
+   flow_entry->buffer_id = ntohl (flow_modify_msg->buffer_id);
+   flow_entry->creation_time = time_msec ();
+   flow_entry->last_used = flow_entry->creation_time;
+   ofp_flow_schedule (flow_entry);
+   ofp_flow_evict_update (table, flow_entry);
+   return 0;
+}
+
+static uint32_t
+ofp_flow_modify_entry (struct openflow_entry *entry, struct ofp_flow_mod_args *args)
+{
+   uint32_t error;
+
+   error = ofp_flow_set_instructions (entry, args->instructions, args->instructions_len);
+   if (error)
+      return error;
+   if (args->flags & OFPFF_RESET_COUNTS) {
+      entry->packet_count = 0;
+      entry->byte_count = 0;
+   }
+   return 0;
+}
+
+static uint32_t
+ofp_flow_modify (struct openflow_table *table, struct ofp_flow_mod_args *args, bool strict)
+{
+   struct openflow_entry *entry;
+   uint32_t error, i;
+
+   if (strict) {
+      entry = ofp_flow_table_find_strict (table, &args->match, args->priority);
+      if (entry && (entry->cookie & args->cookie_mask) == (args->cookie & args->cookie_mask))
+         return ofp_flow_modify_entry (entry, args);
+      return 0;
+   }
+
+   error = ofp_flow_table_select (table, &args->match);
+   for (i=0;!error && i<ofp_flow_selection.n;i++) {
+      entry = ofp_flow_selection.entries[i];
+      if ((entry->cookie & args->cookie_mask) == (args->cookie & args->cookie_mask))
+         error = ofp_flow_modify_entry (entry, args);
+   }
+   return error;
+}
+
+static bool
+ofp_flow_delete_selects (struct openflow_entry *entry, struct ofp_flow_mod_args *args)
+{
+   return (entry->cookie & args->cookie_mask) == (args->cookie & args->cookie_mask) &&
+          ofp_flow_has_output (entry, args->out_port, args->out_group);
+}
+
+static uint32_t
+ofp_flow_delete (struct openflow_table *table, struct ofp_flow_mod_args *args, bool strict)
+{
+   struct openflow_entry *entry;
+   uint32_t error, i;
+
+   if (strict) {
+      entry = ofp_flow_table_find_strict (table, &args->match, args->priority);
+      if (entry && ofp_flow_delete_selects (entry, args))
+         ofp_flow_remove (table, entry, OFPRR_DELETE);
+      return 0;
+   }
+
+   error = ofp_flow_table_select (table, &args->match);
+   if (error)
+      return error;
+   for (i=0;i<ofp_flow_selection.n;i++) {
+      entry = ofp_flow_selection.entries[i];
+      if (ofp_flow_delete_selects (entry, args))
+         ofp_flow_remove (table, entry, OFPRR_DELETE);
+   }
+   return 0;
+}
+
+uint8_t
+process_flow_modify_message (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_flow_mod *flow_modify_msg = (struct ofp_flow_mod *) (buf);
+   struct ofp_flow_mod_args args;
+   struct openflow_table *table = NULL;
+   uint16_t msg_len = ntohs (flow_modify_msg->header.length);
+   uint16_t match_len = ntohs (flow_modify_msg->match.length);
+   uint16_t match_offset = offsetof(struct ofp_flow_mod, match);
+   uint8_t table_id = flow_modify_msg->table_id;
+   uint8_t command = flow_modify_msg->command;
+   uint32_t error;
+   uint8_t i;
+
+   /* The match is padded to a multiple of 8 and followed by the
+    * instructions */
+   if (match_len < 4 || match_offset + (match_len + 7) / 8 * 8 > msg_len) {
+      send_error_message(connection, ntohl (flow_modify_msg->header.xid), OFPET_BAD_MATCH, OFPBMC_BAD_LEN);
+      return 0;
+   }
+   memset(&args,0,sizeof(struct ofp_flow_mod_args));
+   args.msg = flow_modify_msg;
+   args.instructions = buf + match_offset + (match_len + 7) / 8 * 8;
+   args.instructions_len = msg_len - match_offset - (match_len + 7) / 8 * 8;
+   args.priority = ntohs (flow_modify_msg->priority);
+   args.flags = ntohs (flow_modify_msg->flags);
+   args.cookie = ntohl_64 (flow_modify_msg->cookie);
+   args.cookie_mask = ntohl_64 (flow_modify_msg->cookie_mask);
+   args.out_port = ntohl (flow_modify_msg->out_port);
+   args.out_group = ntohl (flow_modify_msg->out_group);
+
+   error = ofp_flow_match_from_ofp (&flow_modify_msg->match, match_len, &args.match);
+   if (!error)
+      error = ofp_instructions_validate (args.instructions, args.instructions_len);
+   if (!error && table_id >= ofp_switch.features.n_tables &&
+       !(table_id == OFPTT_ALL && 
+         (command == OFPFC_DELETE || command == OFPFC_DELETE_STRICT)))
+      error = OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_BAD_TABLE_ID);
+   if (error) {
+      send_error_message(connection, ntohl (flow_modify_msg->header.xid),
+                         OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+      return 0;
+   }
+   if (table_id != OFPTT_ALL)
+      table = &ofp_switch.features.tables[table_id];
+
+   switch (command) {
+   case OFPFC_ADD:
+      /* add does not filter on the cookie */
+      args.cookie_mask = 0;
+      error = ofp_flow_add (table, &args);
+      break;
+   case OFPFC_MODIFY:
+   case OFPFC_MODIFY_STRICT:
+      error = ofp_flow_modify (table, &args, command == OFPFC_MODIFY_STRICT);
+      break;
+   case OFPFC_DELETE:
+   case OFPFC_DELETE_STRICT:
+      if (table) {
+         error = ofp_flow_delete (table, &args, command == OFPFC_DELETE_STRICT);
+      }
+      else {
+         for (i=0;!error && i<ofp_switch.features.n_tables;i++)
+            error = ofp_flow_delete (&ofp_switch.features.tables[i], &args,
+                                     command == OFPFC_DELETE_STRICT);
+      }
+      break;
+   default:
+      error = OFP_ERROR(OFPET_FLOW_MOD_FAILED, OFPFMFC_BAD_COMMAND);
+      break;
+   }
+   /* The buffered packet goes through the tables as if sent by a
+    * packet-out, the flow_mod stays applied if the buffer is gone */
+   if (!error && (command == OFPFC_ADD || command == OFPFC_MODIFY ||
+                  command == OFPFC_MODIFY_STRICT) &&
+       ntohl (flow_modify_msg->buffer_id) != OFP_NO_BUFFER) {
+      struct ofp_action_output output;
+
+      memset (&output, 0, sizeof(output));
+      output.type = htons (OFPAT_OUTPUT);
+      output.len = htons (sizeof(output));
+      output.port = htonl (OFPP_TABLE);
+      output.max_len = htons (OFPCML_NO_BUFFER);
+      error = ofp_pkt_buf_output (ntohl (flow_modify_msg->buffer_id),
+                                  (struct ofp_action_header *) &output,
+                                  sizeof(output));
+   }
+   if (error)
+      send_error_message(connection, ntohl (flow_modify_msg->header.xid),
+                         OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+   return 0;
+}
+
+/* The actions follow the fixed part, the rest of the message is the
+ * packet when it is not buffered */
+uint8_t
+process_packet_out_message (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_packet_out *packet = (struct ofp_packet_out *) buf;
+   uint32_t buffer_id = ntohl (packet->buffer_id);
+   uint16_t msg_len = ntohs (packet->header.length);
+   uint16_t actions_len = ntohs (packet->actions_len);
+   char *actions = buf + sizeof(struct ofp_packet_out);
+   uint32_t error = 0;
+
+   if (actions_len > msg_len - sizeof(struct ofp_packet_out))
+      error = OFP_ERROR(OFPET_BAD_REQUEST, OFPBRC_BAD_LEN);
+   if (!error)
+      error = ofp_actions_validate (actions, actions_len);
+   if (!error && buffer_id != OFP_NO_BUFFER)
+      error = ofp_pkt_buf_output (buffer_id,
+                                  (struct ofp_action_header *) actions,
+                                  actions_len);
+   else if (!error && ofp_packet_output)
+      ofp_packet_output ((uint8_t *) actions + actions_len,
+                         msg_len - sizeof(struct ofp_packet_out) - actions_len,
+                         ntohl (packet->in_port),
+                         (struct ofp_action_header *) actions, actions_len);
+   if (error)
+      send_error_message (connection, ntohl (packet->header.xid),
+                          OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+   return 0;
+}
+
+uint8_t
+process_table_modify_message (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_table_mod *table_modify_msg = (struct ofp_table_mod *) (buf);
+   struct ofp_table_mod_prop_header *prop;
+   struct ofp_table_mod_prop_eviction *eviction_prop = NULL;
+   struct ofp_table_mod_prop_vacancy *vacancy_prop = NULL;
+   struct openflow_table *table;
+   uint16_t msg_len = ntohs (table_modify_msg->header.length);
+   uint16_t offset, prop_len;
+   uint8_t table_id = table_modify_msg->table_id;
+   uint32_t config_flag = ntohl (table_modify_msg->config);
+   uint32_t i, first, last;
+
+   if (table_id != OFPTT_ALL && table_id >= ofp_switch.features.n_tables) {
+      send_error_message(connection, ntohl (table_modify_msg->header.xid), OFPET_TABLE_MOD_FAILED, OFPTMFC_BAD_TABLE);
+      return 0;
+   }
+   if (config_flag & ~(OFPTC_DEPRECATED_MASK | OFPTC_EVICTION | OFPTC_VACANCY_EVENTS)) {
+      send_error_message(connection, ntohl (table_modify_msg->header.xid), OFPET_TABLE_MOD_FAILED, OFPTMFC_BAD_CONFIG);
+      return 0;
+   }
+
+   for (offset = sizeof(struct ofp_table_mod); 
+        offset + sizeof(struct ofp_table_mod_prop_header) <= msg_len;
+        offset += (prop_len + 7) / 8 * 8) {
+      prop = (struct ofp_table_mod_prop_header *) (buf + offset);
+      prop_len = ntohs (prop->length);
+      if (prop_len < sizeof(struct ofp_table_mod_prop_header) || prop_len > msg_len - offset) {
+         send_error_message(connection, ntohl (table_modify_msg->header.xid), OFPET_TABLE_MOD_FAILED, OFPTMFC_BAD_CONFIG);
+         return 0;
+      }
+      if (ntohs (prop->type) == OFPTMPT_EVICTION &&
+          prop_len >= sizeof(struct ofp_table_mod_prop_eviction))
+         eviction_prop = (struct ofp_table_mod_prop_eviction *) prop;
+      else if (ntohs (prop->type) == OFPTMPT_VACANCY &&
+               prop_len >= sizeof(struct ofp_table_mod_prop_vacancy))
+         vacancy_prop = (struct ofp_table_mod_prop_vacancy *) prop;
+   }
+
+   if (vacancy_prop && vacancy_prop->vacancy_down > vacancy_prop->vacancy_up) {
+      send_error_message(connection, ntohl (table_modify_msg->header.xid), OFPET_TABLE_MOD_FAILED, OFPTMFC_BAD_CONFIG);
+      return 0;
+   }
+
+   first = (table_id == OFPTT_ALL) ? 0 : table_id;
+   last = (table_id == OFPTT_ALL) ? ofp_switch.features.n_tables : table_id + 1u;
+   for (i=first;i<last;i++) {
+      table = &ofp_switch.features.tables[i];
+      table->config_flag = config_flag & ~OFPTC_DEPRECATED_MASK;
+      if (eviction_prop)
+         ofp_flow_table_set_eviction (table, ntohl (eviction_prop->flags));
+      if (vacancy_prop) {
+         table->vacancy_down = vacancy_prop->vacancy_down;
+         table->vacancy_up = vacancy_prop->vacancy_up;
+      }
+      /* Start from the side of the thresholds the table is on now */
+      table->vacancy = ofp_flow_table_vacancy (table);
+      table->vacancy_next = (table->vacancy < table->vacancy_down) ?
+                            OFPTR_VACANCY_UP : OFPTR_VACANCY_DOWN;
+   }
+   return 0;
+}
+
+/* Groups are kept in a list in the order they were added, which is the
+ * order of the group stats and description replies */
+static inline struct openflow_group_entry *
+ofp_group_next (struct openflow_group_entry *group_entry)
+{
+   return ofp_entry_list_next (&ofp_switch.group_table->groups, group_entry);
+}
+
+static uint32_t ofp_group_visit_gen;
+
+/* Whether following the group actions of 'group_entry', group after
+ * group, gets to 'group_id'. A group is walked at most once per check,
+ * so the cost is the part of the chain graph below the group. */
+static bool
+ofp_group_reaches (struct openflow_group_entry *group_entry, uint32_t group_id)
+{
+   struct ofp_switch_bucket *bucket;
+   struct openflow_group_entry *next;
+   uint32_t next_id, i;
+   uint16_t offset;
+
+   if (group_entry->group_id == group_id)
+      return TRUE;
+   if (group_entry->visit_gen == ofp_group_visit_gen)
+      return FALSE;
+   group_entry->visit_gen = ofp_group_visit_gen;
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      offset = 0;
+      while (ofp_actions_next_group ((char *) bucket->actions, bucket->actions_len,
+                                     &offset, &next_id)) {
+         next = ofp_group_find (ofp_switch.group_table, next_id);
+         if (next && ofp_group_reaches (next, group_id))
+            return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+static uint32_t ofp_group_watch_gen;
+
+/* Whether the liveness of 'group_entry' depends on group 'group_id',
+ * following the groups its buckets watch. Groups watching each other
+ * would wait for each other to come up forever. */
+static bool
+ofp_group_watches (struct openflow_group_entry *group_entry, uint32_t group_id)
+{
+   struct ofp_switch_bucket *bucket;
+   struct openflow_group_entry *watched;
+   uint32_t i;
+
+   if (group_entry->group_id == group_id)
+      return TRUE;
+   if (group_entry->watch_gen == ofp_group_watch_gen)
+      return FALSE;
+   group_entry->watch_gen = ofp_group_watch_gen;
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      if (bucket->watch_group == OFPG_ANY)
+         continue;
+      watched = ofp_group_find (ofp_switch.group_table, bucket->watch_group);
+      if (watched && ofp_group_watches (watched, group_id))
+         return TRUE;
+   }
+   return FALSE;
+}
+
+/* Group actions of a bucket of group 'group_id' must forward to groups
+ * which exist and which do not lead back to the group */
+static uint32_t
+ofp_group_chain_check (uint32_t group_id, const char *actions, uint16_t len)
+{
+   struct openflow_group_entry *next;
+   uint32_t next_id;
+   uint16_t offset = 0;
+
+   while (ofp_actions_next_group (actions, len, &offset, &next_id)) {
+      if (next_id == group_id)
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_LOOP);
+      next = ofp_group_find (ofp_switch.group_table, next_id);
+      if (!next)
+         return OFP_ERROR(OFPET_BAD_ACTION, OFPBAC_BAD_OUT_GROUP);
+      if (ofp_group_reaches (next, group_id))
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_LOOP);
+   }
+   return 0;
+}
+
+/* Compile the buckets of a group_mod into one allocation: the array
+ * of buckets, the select table of select groups, then the actions of
+ * the buckets, packed and still in wire format. Executing the group
+ * then walks contiguous memory and freeing it is a single call. */
+static uint32_t
+ofp_group_compile (struct ofp_group_mod *group_modify_msg,
+                   struct ofp_switch_bucket **bucket_list, uint32_t *n_buckets,
+                   uint16_t **select_lut)
+{
+   uint32_t group_id = ntohl (group_modify_msg->group_id);
+   uint32_t watch_port, watch_group;
+   uint16_t msg_len = ntohs (group_modify_msg->header.length);
+   struct ofp_msg_view msg = { (char *) group_modify_msg, msg_len };
+   struct ofp_switch_bucket *buckets;
+   struct ofp_bucket *msg_bucket;
+   char *actions;
+   uint32_t n = 0, actions_len = 0, lut_len = 0, error, i;
+   uint16_t offset, bucket_len;
+
+   *bucket_list = NULL;
+   *n_buckets = 0;
+   *select_lut = NULL;
+   if (group_modify_msg->type > OFPGT_FF)
+      return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_BAD_TYPE);
+   ofp_group_visit_gen++;
+   ofp_group_watch_gen++;
+
+   for (offset = sizeof(struct ofp_group_mod); offset < msg_len; offset += bucket_len) {
+      msg_bucket = ofp_msg_view_pull (&msg, offset, sizeof(struct ofp_bucket));
+      if (!msg_bucket)
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_BAD_BUCKET);
+      bucket_len = ntohs (msg_bucket->len);
+      if (bucket_len < sizeof(struct ofp_bucket) || bucket_len % 8 ||
+          !ofp_msg_view_pull (&msg, offset, bucket_len))
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_BAD_BUCKET);
+      error = ofp_actions_validate ((char *) msg_bucket->actions,
+                                    bucket_len - sizeof(struct ofp_bucket));
+      if (!error)
+         error = ofp_group_chain_check (group_id, (char *) msg_bucket->actions,
+                                        bucket_len - sizeof(struct ofp_bucket));
+      if (error)
+         return error;
+      watch_port = ntohl (msg_bucket->watch_port);
+      watch_group = ntohl (msg_bucket->watch_group);
+      /* Only fast failover depends on the liveness of the port, other
+       * types leave the ports past the tracked range untracked */
+      if ((group_modify_msg->type == OFPGT_FF &&
+           watch_port != OFPP_ANY && watch_port >= OFP_PORT_LIVE_MAX) ||
+          (watch_group != OFPG_ANY && watch_group != group_id &&
+           !ofp_group_find (ofp_switch.group_table, watch_group)) ||
+          (group_modify_msg->type == OFPGT_FF &&
+           watch_port == OFPP_ANY && watch_group == OFPG_ANY))
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_BAD_WATCH);
+      if (watch_group == group_id ||
+          (watch_group != OFPG_ANY &&
+           ofp_group_watches (ofp_group_find (ofp_switch.group_table, watch_group), group_id)))
+         return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_LOOP);
+      actions_len += bucket_len - sizeof(struct ofp_bucket);
+      n++;
+   }
+   if (group_modify_msg->type == OFPGT_INDIRECT && n != 1)
+      return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_INVALID_GROUP);
+   if (!n)
+      return 0;
+   if (n >= OFP_GROUP_NO_BUCKET)
+      return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_BUCKETS);
+
+   /* select table length keeps the actions 8 byte aligned */
+   if (group_modify_msg->type == OFPGT_SELECT)
+      lut_len = (OFP_GROUP_SELECT_SLOTS * sizeof(uint16_t) + 7) / 8 * 8;
+   buckets = malloc (n * sizeof(struct ofp_switch_bucket) + lut_len + actions_len);
+   if (!buckets)
+      return OFP_ERROR(OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_BUCKETS);
+   if (lut_len)
+      *select_lut = (uint16_t *) &buckets[n];
+   actions = (char *) &buckets[n] + lut_len;
+   offset = sizeof(struct ofp_group_mod);
+   for (i=0;i<n;i++) {
+      msg_bucket = (struct ofp_bucket *) ((char *) group_modify_msg + offset);
+      bucket_len = ntohs (msg_bucket->len);
+      buckets[i].weight = ntohs (msg_bucket->weight);
+      buckets[i].actions_len = bucket_len - sizeof(struct ofp_bucket);
+      buckets[i].watch_port = ntohl (msg_bucket->watch_port);
+      buckets[i].watch_group = ntohl (msg_bucket->watch_group);
+      buckets[i].live = TRUE;
+      buckets[i].actions = (struct ofp_action_header *) actions;
+      memcpy (actions, msg_bucket->actions, buckets[i].actions_len);
+      actions += buckets[i].actions_len;
+      offset += bucket_len;
+   }
+   *bucket_list = buckets;
+   *n_buckets = n;
+   return 0;
+}
+
+/* Give the select table slots listed in 'slots' to the live buckets in
+ * proportion to their weights (equal shares if all weights are 0). Only
+ * runs on group changes, packets just index the table. */
+static void
+ofp_group_select_assign (struct openflow_group_entry *group_entry,
+                         const uint16_t *slots, uint32_t n_slots)
+{
+   struct ofp_switch_bucket *bucket;
+   uint64_t total_weight = 0;
+   uint32_t share, left = n_slots, n_live = 0, i, k = 0;
+   bool equal;
+
+   for (i=0;i<group_entry->n_buckets;i++) {
+      if (group_entry->bucket_list[i].live) {
+         total_weight += group_entry->bucket_list[i].weight;
+         n_live++;
+      }
+   }
+   if (!n_live) {
+      for (i=0;i<n_slots;i++)
+         group_entry->select_lut[slots[i]] = OFP_GROUP_NO_BUCKET;
+      return;
+   }
+   equal = (total_weight == 0);
+   if (equal)
+      total_weight = n_live;
+
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      if (!bucket->live)
+         continue;
+      share = (uint64_t) n_slots * (equal ? 1 : bucket->weight) / total_weight;
+      for (; share && k < n_slots; share--, left--)
+         group_entry->select_lut[slots[k++]] = i;
+   }
+   /* Rounding leftovers go one by one to the weighted live buckets */
+   for (i=0;left;i=(i+1)%group_entry->n_buckets) {
+      bucket = &group_entry->bucket_list[i];
+      if (bucket->live && (equal || bucket->weight)) {
+         group_entry->select_lut[slots[k++]] = i;
+         left--;
+      }
+   }
+}
+
+static void
+ofp_group_select_rebuild (struct openflow_group_entry *group_entry)
+{
+   uint16_t slots[OFP_GROUP_SELECT_SLOTS];
+   uint32_t i;
+
+   if (!group_entry->select_lut)
+      return;
+   for (i=0;i<OFP_GROUP_SELECT_SLOTS;i++)
+      slots[i] = i;
+   ofp_group_select_assign (group_entry, slots, OFP_GROUP_SELECT_SLOTS);
+}
+
+/* A bucket went dead or came back. A dead bucket only hands its own
+ * slots over to the live ones, so the flows of the other buckets keep
+ * their bucket; a bucket coming back needs its share back, which means
+ * a full rebuild. */
+void
+ofp_group_bucket_set_live (struct openflow_group_entry *group_entry,
+                           uint32_t bucket_index, bool live)
+{
+   uint16_t slots[OFP_GROUP_SELECT_SLOTS];
+   uint32_t i, n = 0;
+
+   if (group_entry->bucket_list[bucket_index].live == live)
+      return;
+   group_entry->bucket_list[bucket_index].live = live;
+   if (!group_entry->select_lut)
+      return;
+   if (live) {
+      ofp_group_select_rebuild (group_entry);
+      return;
+   }
+   for (i=0;i<OFP_GROUP_SELECT_SLOTS;i++) {
+      if (group_entry->select_lut[i] == bucket_index)
+         slots[n++] = i;
+   }
+   ofp_group_select_assign (group_entry, slots, n);
+}
+
+/* Bucket of a select group for a packet, from its flow hash, or NULL if
+ * no bucket is live, for the datapath */
+struct ofp_switch_bucket *
+ofp_group_select_bucket (struct openflow_group_entry *group_entry, uint32_t hash)
+{
+   uint16_t index = group_entry->select_lut[hash & (OFP_GROUP_SELECT_SLOTS - 1)];
+
+   return index == OFP_GROUP_NO_BUCKET ? NULL : &group_entry->bucket_list[index];
+}
+
+static inline bool
+ofp_port_is_live (uint32_t port_no)
+{
+   return port_no < OFP_PORT_LIVE_MAX &&
+          (ofp_switch.port_live[port_no / 64] & (1ULL << (port_no % 64)));
+}
+
+/* Watched ports past OFP_PORT_LIVE_MAX are always live */
+static inline bool
+ofp_watch_port_tracked (uint32_t watch_port)
+{
+   return watch_port != OFPP_ANY && watch_port < OFP_PORT_LIVE_MAX;
+}
+
+static bool
+ofp_group_bucket_is_live (struct ofp_switch_bucket *bucket)
+{
+   struct openflow_group_entry *watched;
+
+   if (ofp_watch_port_tracked (bucket->watch_port) &&
+       !ofp_port_is_live (bucket->watch_port))
+      return FALSE;
+   if (bucket->watch_group != OFPG_ANY) {
+      watched = ofp_group_find (ofp_switch.group_table, bucket->watch_group);
+      if (!watched || !watched->live)
+         return FALSE;
+   }
+   return TRUE;
+}
+
+static uint8_t
+ofp_watch_list_add (struct ofp_watch_list *list, struct openflow_group_entry *group_entry,
+                    uint32_t bucket)
+{
+   struct ofp_group_watch *watches;
+
+   if (list->n == list->max) {
+      uint32_t max = list->max ? list->max * 2 : 4;
+      watches = realloc (list->watches, max * sizeof(struct ofp_group_watch));
+      if (!watches)
+         return 1;
+      list->watches = watches;
+      list->max = max;
+   }
+   list->watches[list->n].group = group_entry;
+   list->watches[list->n].bucket = bucket;
+   list->n++;
+   return 0;
+}
+
+static void
+ofp_watch_list_del (struct ofp_watch_list *list, struct openflow_group_entry *group_entry)
+{
+   uint32_t i;
+
+   for (i=0;i<list->n;) {
+      if (list->watches[i].group == group_entry)
+         list->watches[i] = list->watches[--list->n];
+      else
+         i++;
+   }
+}
+
+static void ofp_group_bucket_refresh (struct openflow_group_entry *group_entry,
+                                      uint32_t bucket_index);
+
+/* Recompute the first live bucket and the liveness of a group, and if
+ * the group went up or down, the buckets watching it, all at once */
+static void
+ofp_group_refresh (struct openflow_group_entry *group_entry)
+{
+   struct ofp_watch_list *watchers = &group_entry->watchers;
+   bool was_live = group_entry->live;
+   uint32_t i;
+
+   group_entry->first_live = OFP_GROUP_NO_BUCKET;
+   for (i=0;i<group_entry->n_buckets;i++) {
+      if (group_entry->bucket_list[i].live) {
+         group_entry->first_live = i;
+         break;
+      }
+   }
+   group_entry->live = (group_entry->first_live != OFP_GROUP_NO_BUCKET);
+   if (group_entry->live == was_live)
+      return;
+   for (i=0;i<watchers->n;i++)
+      ofp_group_bucket_refresh (watchers->watches[i].group, watchers->watches[i].bucket);
+}
+
+static void
+ofp_group_bucket_refresh (struct openflow_group_entry *group_entry, uint32_t bucket_index)
+{
+   struct ofp_switch_bucket *bucket = &group_entry->bucket_list[bucket_index];
+
+   if (bucket->live == ofp_group_bucket_is_live (bucket))
+      return;
+   ofp_group_bucket_set_live (group_entry, bucket_index, !bucket->live);
+   ofp_group_refresh (group_entry);
+}
+
+/* Register the watches of the buckets of a group and work out which
+ * buckets are live */
+static uint8_t
+ofp_group_attach (struct openflow_group_entry *group_entry)
+{
+   struct ofp_switch_bucket *bucket;
+   struct openflow_group_entry *watched;
+   uint32_t next_id, i;
+   uint16_t offset;
+
+   /* Chained groups count the buckets forwarding to them */
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      offset = 0;
+      while (ofp_actions_next_group ((char *) bucket->actions, bucket->actions_len,
+                                     &offset, &next_id)) {
+         watched = ofp_group_find (ofp_switch.group_table, next_id);
+         if (watched)
+            watched->n_group_refs++;
+      }
+   }
+   if (!ofp_switch.port_watchers) {
+      ofp_switch.port_watchers = calloc (OFP_PORT_LIVE_MAX, sizeof(struct ofp_watch_list));
+      if (!ofp_switch.port_watchers)
+         return 1;
+   }
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      if (ofp_watch_port_tracked (bucket->watch_port) &&
+          ofp_watch_list_add (&ofp_switch.port_watchers[bucket->watch_port], group_entry, i))
+         return 1;
+      watched = (bucket->watch_group != OFPG_ANY) ?
+                ofp_group_find (ofp_switch.group_table, bucket->watch_group) : NULL;
+      if (watched && ofp_watch_list_add (&watched->watchers, group_entry, i))
+         return 1;
+      bucket->live = ofp_group_bucket_is_live (bucket);
+   }
+   ofp_group_select_rebuild (group_entry);
+   return 0;
+}
+
+static void
+ofp_group_detach (struct openflow_group_entry *group_entry)
+{
+   struct ofp_switch_bucket *bucket;
+   struct openflow_group_entry *watched;
+   uint32_t next_id, i;
+   uint16_t offset;
+
+   for (i=0;i<group_entry->n_buckets;i++) {
+      bucket = &group_entry->bucket_list[i];
+      offset = 0;
+      while (ofp_actions_next_group ((char *) bucket->actions, bucket->actions_len,
+                                     &offset, &next_id)) {
+         watched = ofp_group_find (ofp_switch.group_table, next_id);
+         if (watched)
+            watched->n_group_refs--;
+      }
+      if (ofp_watch_port_tracked (bucket->watch_port) && ofp_switch.port_watchers)
+         ofp_watch_list_del (&ofp_switch.port_watchers[bucket->watch_port], group_entry);
+      watched = (bucket->watch_group != OFPG_ANY) ?
+                ofp_group_find (ofp_switch.group_table, bucket->watch_group) : NULL;
+      if (watched)
+         ofp_watch_list_del (&watched->watchers, group_entry);
+   }
+}
+
+/* Bucket a fast failover group forwards to, or NULL if none is live,
+ * for the datapath. Failover already happened when the watched port or
+ * group changed. */
+struct ofp_switch_bucket *
+ofp_group_ff_bucket (struct openflow_group_entry *group_entry)
+{
+   return group_entry->first_live == OFP_GROUP_NO_BUCKET ? NULL :
+          &group_entry->bucket_list[group_entry->first_live];
+}
+
+/* Port liveness for the fast failover groups. Called on the port status
+ * path, it fails over every bucket watching the port in one go. */
+void
+ofp_port_set_live (uint32_t port_no, bool live)
+{
+   struct ofp_watch_list *watchers;
+   uint32_t i;
+
+   if (port_no >= OFP_PORT_LIVE_MAX || ofp_port_is_live (port_no) == live)
+      return;
+   if (live)
+      ofp_switch.port_live[port_no / 64] |= 1ULL << (port_no % 64);
+   else
+      ofp_switch.port_live[port_no / 64] &= ~(1ULL << (port_no % 64));
+   if (!ofp_switch.port_watchers)
+      return;
+   watchers = &ofp_switch.port_watchers[port_no];
+   for (i=0;i<watchers->n;i++)
+      ofp_group_bucket_refresh (watchers->watches[i].group, watchers->watches[i].bucket);
+}
+
+/* A port was added, removed or changed: update the groups, then tell
+ * the controllers */
+void
+ofp_port_status_changed (struct ofp_port *port, enum ofp_port_reason reason)
+{
+   uint64_t subscribers;
+   uint16_t length;
+   void *buf;
+
+   ofp_port_set_live (port->port_no, reason != OFPPR_DELETE &&
+                      !(port->config & OFPPC_PORT_DOWN) &&
+                      !(port->state & OFPPS_LINK_DOWN));
+   subscribers = ofp_async_subscribers (OFP_ASYNC_PORT_STATUS, reason);
+   if (subscribers && (buf = ofp_port_status_encode (port, reason, &length)))
+      ofp_async_publish (subscribers, OFPT_PORT_STATUS, buf, length);
+}
+
+uint8_t
+ofp_delete_group (struct openflow_group_entry *group_entry)
+{
+   free (group_entry->bucket_list);
+   group_entry->bucket_list = NULL;
+   group_entry->select_lut = NULL;
+   group_entry->n_buckets = 0;
+   return 0;
+}
+
+uint8_t
+process_group_modify_add_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+{
+   struct openflow_group_table *group_table = ofp_switch.group_table;
+   struct openflow_group_entry *group_entry = NULL;
+   struct ofp_switch_bucket *bucket_list;
+   uint16_t *select_lut;
+   uint32_t group_id = ntohl(group_modify_msg->group_id);
+   uint32_t n_buckets, error;
+
+   if (group_id > OFPG_MAX) {
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_INVALID_GROUP);
+     return  0;
+   }
+
+   if (IS_GROUP_ALREADY_EXISTS(group_id)) {
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_GROUP_EXISTS);
+     return  0;
+   }
+
+   if (group_table->total_group_count > OFPG_MAX ||
+       ofp_id_index_reserve (&group_table->index)) {
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
+     return  0;
+   }
+
+   error = ofp_group_compile (group_modify_msg, &bucket_list, &n_buckets, &select_lut);
+   if (error) {
+     send_error_message(connection, xid, OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+     return  0;
+   }
+
+   group_entry = malloc (sizeof (struct openflow_group_entry));
+   if (!group_entry) {
+     free (bucket_list);
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
+     return  0;
+   }
+   memset(group_entry,0,sizeof(struct openflow_group_entry));
+
+   group_entry->type = group_modify_msg->type; 
+   group_entry->group_id = group_id; 
+   group_entry->n_buckets = n_buckets;
+   group_entry->bucket_list = bucket_list;
+   group_entry->select_lut = select_lut;
+   if (ofp_group_attach (group_entry)) {
+     ofp_group_detach (group_entry);
+     ofp_delete_group (group_entry);
+     free (group_entry);
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
+     return  0;
+   }
+   ofp_group_refresh (group_entry);
+   ofp_entry_list_append (&group_table->groups, group_entry);
+   ofp_id_index_link (&group_table->index, group_entry);
+   group_table->total_group_count++;
+   return 0;
+}
+
+/* Remove the flows forwarding to a group, in time proportional to
+ * their number */
+static void
+ofp_group_remove_flows (struct openflow_group_entry *group_entry)
+{
+   struct openflow_entry *entry;
+
+   while (group_entry->flow_refs) {
+      entry = group_entry->flow_refs->flow;
+      ofp_flow_remove (&ofp_switch.features.tables[entry->table_id], entry, OFPRR_GROUP_DELETE);
+   }
+}
+
+/* Only groups no other group forwards to or watches are removed */
+static void
+ofp_group_remove (struct openflow_group_table *group_table,
+                  struct openflow_group_entry *group_entry)
+{
+   ofp_group_remove_flows (group_entry);
+   ofp_group_detach (group_entry);
+   ofp_entry_list_remove (&group_table->groups, group_entry);
+   ofp_id_index_unlink (&group_table->index, group_entry);
+   group_table->total_group_count--;
+   ofp_delete_group (group_entry);
+   free (group_entry->watchers.watches);
+   free (group_entry);
+}
+
+uint8_t
+process_group_add_modify_del_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+{
+   struct openflow_group_table *group_table = ofp_switch.group_table;
+   struct openflow_group_entry *group_entry = NULL;
+   struct openflow_group_entry *next_group_entry = NULL;
+   uint32_t group_id, i;
+
+   group_id = ntohl (group_modify_msg->group_id); 
+
+   if (group_id == OFPG_ALL) {
+     /* Flows first, they still point to the groups */
+     for (group_entry = ofp_entry_list_first (&group_table->groups); group_entry;
+          group_entry = ofp_group_next (group_entry))
+        ofp_group_remove_flows (group_entry);
+     for (group_entry = ofp_entry_list_first (&group_table->groups); group_entry;
+          group_entry = next_group_entry) {
+        next_group_entry = ofp_group_next (group_entry);
+        ofp_delete_group (group_entry);
+        free (group_entry->watchers.watches);
+        free (group_entry);
+     }
+     for (i=0;ofp_switch.port_watchers && i<OFP_PORT_LIVE_MAX;i++)
+        ofp_switch.port_watchers[i].n = 0;
+     group_table->groups.first = NULL;
+     group_table->groups.last = NULL;
+     group_table->total_group_count = 0;
+     ofp_id_index_clear (&group_table->index);
+     return 0;
+   }
+
+   /* Deleting a group which does not exist is not an error */
+   group_entry = ofp_group_find (group_table, group_id);
+   if (!group_entry)
+     return 0;
+   /* Groups forwarding to it or watching it would be left with an id
+    * which could later name another group */
+   if (group_entry->n_group_refs || group_entry->watchers.n) {
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_CHAINED_GROUP);
+     return  0;
+   }
+   ofp_group_remove (group_table, group_entry);
+   return 0;
+}
+
+uint8_t
+process_group_add_modify_mod_message (struct ofp_conn *connection, uint32_t xid, struct ofp_group_mod *group_modify_msg)
+{
+   struct openflow_group_entry *group_entry = NULL;
+   struct ofp_switch_bucket *bucket_list, *old_bucket_list;
+   uint16_t *select_lut, *old_select_lut;
+   uint32_t group_id, n_buckets, old_n_buckets, error;
+   enum ofp_group_type old_type;
+
+   group_id = ntohl (group_modify_msg->group_id); 
+
+   group_entry = ofp_group_find (ofp_switch.group_table, group_id);
+   if (!group_entry) {
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_UNKNOWN_GROUP);
+     return  0;
+   }
+
+   error = ofp_group_compile (group_modify_msg, &bucket_list, &n_buckets, &select_lut);
+   if (error) {
+     send_error_message(connection, xid, OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+     return  0;
+   }
+
+   /* Same entry, new type and buckets. The old buckets are kept until
+    * the new ones are attached, and attached again if that fails: the
+    * watch lists still have room for them, so that cannot fail. */
+   old_type = group_entry->type;
+   old_n_buckets = group_entry->n_buckets;
+   old_bucket_list = group_entry->bucket_list;
+   old_select_lut = group_entry->select_lut;
+   ofp_group_detach (group_entry);
+   group_entry->type = group_modify_msg->type;
+   group_entry->n_buckets = n_buckets;
+   group_entry->bucket_list = bucket_list;
+   group_entry->select_lut = select_lut;
+   if (ofp_group_attach (group_entry)) {
+     ofp_group_detach (group_entry);
+     ofp_delete_group (group_entry);
+     group_entry->type = old_type;
+     group_entry->n_buckets = old_n_buckets;
+     group_entry->bucket_list = old_bucket_list;
+     group_entry->select_lut = old_select_lut;
+     ofp_group_attach (group_entry);
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
+   }
+   else
+     free (old_bucket_list);
+   ofp_group_refresh (group_entry);
+   return 0;
+}
+
+uint8_t
+process_group_modify_message (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_group_mod *group_modify_msg = (struct ofp_group_mod *) (buf);
+   uint16_t command = ntohs(group_modify_msg->command);
+   uint32_t xid = ntohl (group_modify_msg->header.xid);
+
+   if (!ofp_switch.group_table) {
+     ofp_switch.group_table = calloc (1, sizeof(struct openflow_group_table));
+     if (!ofp_switch.group_table) {
+       send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_OUT_OF_GROUPS);
+       return 0;
+     }
+     ofp_switch.group_table->groups.node_offset = offsetof(struct openflow_group_entry, list_node);
+     ofp_switch.group_table->index.id_offset = offsetof(struct openflow_group_entry, group_id);
+   }
+
+   if (command == OFPGC_ADD)
+     return process_group_modify_add_message (connection, xid, group_modify_msg);
+   else if (command == OFPGC_MODIFY)
+     return process_group_add_modify_mod_message (connection, xid, group_modify_msg);
+   else if (command == OFPGC_DELETE)
+     return process_group_add_modify_del_message (connection, xid, group_modify_msg);
+   else
+     send_error_message(connection, xid, OFPET_GROUP_MOD_FAILED, OFPGMFC_BAD_COMMAND);
+
+   return 0;
+}
+   
+/* Meter of a packet, for the datapath */
+struct openflow_meter_entry *
+ofp_meter_lookup (uint32_t meter_id)
+{
+   return ofp_meter_find (ofp_switch.meter_table, meter_id);
+}
+
+/* Meters are kept in a list in the order they were added, for the
+ * meter stats and config replies */
+static inline struct openflow_meter_entry *
+ofp_meter_next (struct openflow_meter_entry *meter_entry)
+{
+   return ofp_entry_list_next (&ofp_switch.meter_table->meters, meter_entry);
+}
+
+/* Cycle clock rate, measured by the reactor against the msec clock */
+static uint64_t ofp_meter_cycles_per_msec = OFP_METER_CYCLES_PER_MSEC;
+static uint64_t ofp_meter_sync_cycles;
+static long long int ofp_meter_sync_msec;
+
+/* Called every reactor cycle, measures the cycle clock once a second */
+void
+ofp_meter_clock_sync (long long int now)
+{
+   uint64_t cycles = ofp_cycles ();
+   uint64_t per_msec;
+
+   if (ofp_meter_sync_msec && now - ofp_meter_sync_msec < 1000)
+      return;
+   if (ofp_meter_sync_msec) {
+      per_msec = (cycles - ofp_meter_sync_cycles) / (now - ofp_meter_sync_msec);
+      if (per_msec)
+         __atomic_store_n (&ofp_meter_cycles_per_msec, per_msec, __ATOMIC_RELAXED);
+   }
+   ofp_meter_sync_cycles = cycles;
+   ofp_meter_sync_msec = now;
+}
+
+/* Grace periods for the meter memory the datapath may still read.
+ * Datapath cores call ofp_meter_quiesce between packet batches, which
+ * publishes the epoch they saw. Bands and meters unlinked in an epoch
+ * are freed by the reactor once every running core saw a later one. */
+static uint64_t ofp_meter_epoch = 1;
+static uint64_t ofp_meter_core_epoch[OFP_METER_MAX_CORES]; /* 0: offline */
+static struct ofp_meter_bands *ofp_meter_retired_bands;
+static struct openflow_meter_entry *ofp_meter_retired;
+
+/* Called by a datapath core when it holds no meter or band pointer */
+void
+ofp_meter_quiesce (uint32_t core)
+{
+   if (core < OFP_METER_MAX_CORES)
+      __atomic_store_n (&ofp_meter_core_epoch[core],
+                        __atomic_load_n (&ofp_meter_epoch, __ATOMIC_SEQ_CST),
+                        __ATOMIC_SEQ_CST);
+}
+
+/* Called by a datapath core which stops metering, so the reclaimer
+ * does not wait for it */
+void
+ofp_meter_core_offline (uint32_t core)
+{
+   if (core < OFP_METER_MAX_CORES)
+      __atomic_store_n (&ofp_meter_core_epoch[core], 0, __ATOMIC_SEQ_CST);
+}
+
+/* Epoch of the memory unlinked so far: a core which saw a later epoch
+ * can no longer reach it */
+static uint64_t
+ofp_meter_retire_epoch (void)
+{
+   return __atomic_fetch_add (&ofp_meter_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Sum of the per core counters of a band */
+static void
+ofp_meter_band_counts (struct ofp_switch_meter_band *band, struct ofp_meter_band_count *count)
+{
+   uint32_t core;
+
+   for (core=0;core<OFP_METER_MAX_CORES;core++) {
+      count->packet_band_count +=
+         __atomic_load_n (&band->credits[core].packet_band_count, __ATOMIC_RELAXED);
+      count->byte_band_count +=
+         __atomic_load_n (&band->credits[core].byte_band_count, __ATOMIC_RELAXED);
+   }
+}
+
+/* 'owner' is the meter the bands were replaced on: the counters the
+ * cores add until the grace period ends are folded into it then */
+static void
+ofp_meter_bands_retire (struct ofp_meter_bands *bands, struct openflow_meter_entry *owner)
+{
+   bands->owner = owner;
+   bands->retired_epoch = ofp_meter_retire_epoch ();
+   bands->retired_next = ofp_meter_retired_bands;
+   ofp_meter_retired_bands = bands;
+}
+
+/* Free the retired bands and meters no running core can still read.
+ * Called every reactor cycle. */
+void
+ofp_meter_reclaim (void)
+{
+   struct ofp_meter_bands **pbands, *bands;
+   struct openflow_meter_entry **pmeter, *meter_entry;
+   uint64_t safe = UINT64_MAX, seen;
+   uint32_t core;
+   uint16_t i;
+
+   if (!ofp_meter_retired_bands && !ofp_meter_retired)
+      return;
+   for (core=0;core<OFP_METER_MAX_CORES;core++) {
+      seen = __atomic_load_n (&ofp_meter_core_epoch[core], __ATOMIC_SEQ_CST);
+      if (seen && seen < safe)
+         safe = seen;
+   }
+   for (pbands = &ofp_meter_retired_bands; (bands = *pbands);) {
+      if (bands->retired_epoch < safe) {
+         *pbands = bands->retired_next;
+         /* Band counters carry over to the band at the same place */
+         for (i=0;bands->owner && i<bands->n_bands &&
+                  i<bands->owner->bands->n_bands;i++)
+            ofp_meter_band_counts (&bands->band[i], &bands->owner->band_base[i]);
+         free (bands);
+      }
+      else
+         pbands = &bands->retired_next;
+   }
+   for (pmeter = &ofp_meter_retired; (meter_entry = *pmeter);) {
+      if (meter_entry->retired_epoch < safe) {
+         *pmeter = meter_entry->retired_next;
+         free (meter_entry->bands);
+         free (meter_entry->shards);
+         free (meter_entry);
+      }
+      else
+         pmeter = &meter_entry->retired_next;
+   }
+}
+
+/* Compile the bands of a meter_mod into a new band block. The bands
+ * keep the meter_mod order, which the band stats follow. */
+static uint32_t
+ofp_meter_compile (struct ofp_meter_mod *meter_modify_msg,
+                   struct ofp_meter_bands **block)
+{
+   uint16_t msg_len = ntohs (meter_modify_msg->header.length);
+   uint16_t flags = ntohs (meter_modify_msg->flags);
+   struct ofp_msg_view msg = { (char *) meter_modify_msg, msg_len };
+   struct ofp_switch_meter_band *bands, band;
+   struct ofp_meter_band_header *msg_band;
+   uint16_t offset, band_len, n = 0, i, j;
+   size_t bands_size, size;
+   void *mem;
+
+   *block = NULL;
+   if ((flags & ~(OFPMF_KBPS | OFPMF_PKTPS | OFPMF_BURST | OFPMF_STATS)) ||
+       ((flags & OFPMF_KBPS) && (flags & OFPMF_PKTPS)))
+      return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_FLAGS);
+
+   for (offset = sizeof(struct ofp_meter_mod); offset < msg_len; offset += band_len) {
+      msg_band = ofp_msg_view_pull (&msg, offset, sizeof(struct ofp_meter_band_drop));
+      if (!msg_band)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_BAND);
+      band_len = ntohs (msg_band->len);
+      if (band_len < sizeof(struct ofp_meter_band_drop) || band_len % 8 ||
+          !ofp_msg_view_pull (&msg, offset, band_len))
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_BAND);
+      if (ntohs (msg_band->type) != OFPMBT_DROP &&
+          ntohs (msg_band->type) != OFPMBT_DSCP_REMARK)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_BAND);
+      if (!msg_band->rate)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_RATE);
+      if ((flags & OFPMF_BURST) && !msg_band->burst_size)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_BURST);
+      if (ntohs (msg_band->type) == OFPMBT_DSCP_REMARK &&
+          !((struct ofp_meter_band_dscp_remark *) msg_band)->prec_level)
+         return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_BAD_BAND_VALUE);
+      n++;
+   }
+   if (n > OFP_METER_MAX_BANDS)
+      return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_BANDS);
+   /* Credits start on their own cache lines */
+   bands_size = (offsetof(struct ofp_meter_bands, band) +
+                 n * sizeof(struct ofp_switch_meter_band) + 63) / 64 * 64;
+   size = bands_size + n * OFP_METER_MAX_CORES * sizeof(struct ofp_meter_credit);
+   if (posix_memalign (&mem, 64, size))
+      return OFP_ERROR(OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_BANDS);
+   memset (mem, 0, size);
+   *block = mem;
+   (*block)->flags = flags;
+   (*block)->n_bands = n;
+   bands = (*block)->band;
+
+   offset = sizeof(struct ofp_meter_mod);
+   for (i=0;i<n;i++) {
+      msg_band = (struct ofp_meter_band_header *) ((char *) meter_modify_msg + offset);
+      memset (&band, 0, sizeof band);
+      band.type = ntohs (msg_band->type);
+      band.len = ntohs (msg_band->len);
+      band.rate = ntohl (msg_band->rate);
+      band.burst_size = ntohl (msg_band->burst_size);
+      if (band.type == OFPMBT_DSCP_REMARK)
+         band.band_specific_date.prec_level =
+            ((struct ofp_meter_band_dscp_remark *) msg_band)->prec_level;
+      /* kb/s are bits per msec, packet/s are thousandths of a packet
+       * per msec */
+      band.fill = (flags & OFPMF_PKTPS) ? band.rate : (int64_t) band.rate * 1000;
+      if (flags & OFPMF_BURST)
+         band.capacity = (flags & OFPMF_PKTPS) ? (int64_t) band.burst_size * 1000 :
+                         (int64_t) band.burst_size * 1000 * 1000;
+      else
+         band.capacity = band.fill * OFP_METER_BURST_MSEC;
+      band.chunk = band.capacity / OFP_METER_CHUNKS ? band.capacity / OFP_METER_CHUNKS : 1;
+      band.tokens = band.capacity;
+      band.last = ofp_cycles ();
+      bands[i] = band;
+      /* Insertion by rate, there are only a few bands */
+      for (j=i;j>0 && bands[(*block)->by_rate[j - 1]].rate > band.rate;j--)
+         (*block)->by_rate[j] = (*block)->by_rate[j - 1];
+      (*block)->by_rate[j] = i;
+      offset += band.len;
+   }
+   for (i=0;i<n;i++)
+      bands[i].credits = (struct ofp_meter_credit *) ((char *) mem + bands_size) +
+                         i * OFP_METER_MAX_CORES;
+   return 0;
+}
+
+/* Hand a meter taken out of the meter table over to the reclaimer,
+ * with its bands and counters */
+uint8_t
+ofp_delete_meter (struct openflow_meter_entry *meter_entry)
+{
+   struct ofp_meter_bands *bands;
+
+   for (bands = ofp_meter_retired_bands; bands; bands = bands->retired_next) {
+      if (bands->owner == meter_entry)
+         bands->owner = NULL;
+   }
+   meter_entry->retired_epoch = ofp_meter_retire_epoch ();
+   meter_entry->retired_next = ofp_meter_retired;
+   ofp_meter_retired = meter_entry;
+   return 0;
+}
+
+/* Refill the shared bucket of a band for the whole msecs elapsed since
+ * the last refill. The core which wins the compare and swap on 'last'
+ * does it, the others go on with the tokens there are. */
+static void
+ofp_meter_band_refill (struct ofp_switch_meter_band *band, uint64_t now)
+{
+   uint64_t cycles_per_msec = __atomic_load_n (&ofp_meter_cycles_per_msec, __ATOMIC_RELAXED);
+   uint64_t last = __atomic_load_n (&band->last, __ATOMIC_RELAXED);
+   uint64_t msec;
+   int64_t add, tokens, full;
+
+   if (now <= last)
+      return;
+   msec = (now - last) / cycles_per_msec;
+   if (!msec)
+      return;
+   if (!__atomic_compare_exchange_n (&band->last, &last, last + msec * cycles_per_msec,
+                                     FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return;
+   if (msec > (uint64_t) (band->capacity / band->fill) + 1)
+      msec = band->capacity / band->fill + 1;
+   add = msec * band->fill;
+   tokens = __atomic_load_n (&band->tokens, __ATOMIC_RELAXED);
+   do {
+      full = tokens + add > band->capacity ? band->capacity : tokens + add;
+   } while (!__atomic_compare_exchange_n (&band->tokens, &tokens, full, FALSE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Spend 'cost' tokens of a band on a core. The core spends its own
+ * credit, and only goes to the shared bucket for a new chunk, so the
+ * shared cache line is touched once per chunk, not once per packet. */
+static bool
+ofp_meter_band_take (struct ofp_switch_meter_band *band, struct ofp_meter_credit *credit,
+                     int64_t cost, uint64_t now)
+{
+   int64_t tokens, want, got;
+
+   if (credit->tokens >= cost) {
+      credit->tokens -= cost;
+      return TRUE;
+   }
+   ofp_meter_band_refill (band, now);
+   want = cost - credit->tokens + band->chunk;
+   tokens = __atomic_load_n (&band->tokens, __ATOMIC_RELAXED);
+   do {
+      if (tokens <= 0)
+         return FALSE;
+      got = tokens < want ? tokens : want;
+   } while (!__atomic_compare_exchange_n (&band->tokens, &tokens, tokens - got, FALSE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   credit->tokens += got;
+   if (credit->tokens < cost)
+      return FALSE;
+   credit->tokens -= cost;
+   return TRUE;
+}
+
+/* Meter a packet of 'n_bytes' on datapath core 'core', for the
+ * datapath. 'now' is the cycle clock of the packet batch, read once per
+ * batch. Returns the band to apply, the highest rate band the packet
+ * exceeds, or NULL if it is within all of them. No lock is taken: the
+ * meter and its bands stay valid until the core calls ofp_meter_quiesce.
+ * Cores past OFP_METER_MAX_CORES have no credits and are not metered. */
+struct ofp_switch_meter_band *
+ofp_meter_apply (struct openflow_meter_entry *meter_entry, uint32_t core,
+                 uint32_t n_bytes, uint64_t now)
+{
+   struct ofp_switch_meter_band *band, *exceeded = NULL;
+   struct ofp_meter_bands *bands;
+   struct ofp_meter_shard *shard;
+   struct ofp_meter_credit *credit;
+   int64_t cost;
+   uint16_t i;
+
+   if (core >= OFP_METER_MAX_CORES)
+      return NULL;
+   shard = &meter_entry->shards[core];
+   bands = __atomic_load_n (&meter_entry->bands, __ATOMIC_ACQUIRE);
+
+   /* Counters are only written by their core: relaxed stores, no locked
+    * increments, and stats readers only ever load them */
+   __atomic_store_n (&shard->packet_in_count, shard->packet_in_count + 1, __ATOMIC_RELAXED);
+   __atomic_store_n (&shard->byte_in_count, shard->byte_in_count + n_bytes, __ATOMIC_RELAXED);
+
+   cost = (bands->flags & OFPMF_PKTPS) ? 1000 : (int64_t) n_bytes * 8 * 1000;
+   for (i=0;i<bands->n_bands;i++) {
+      band = &bands->band[bands->by_rate[i]];
+      if (!ofp_meter_band_take (band, &band->credits[core], cost, now))
+         exceeded = band;
+   }
+   if (exceeded) {
+      credit = &exceeded->credits[core];
+      __atomic_store_n (&credit->packet_band_count, credit->packet_band_count + 1,
+                        __ATOMIC_RELAXED);
+      __atomic_store_n (&credit->byte_band_count, credit->byte_band_count + n_bytes,
+                        __ATOMIC_RELAXED);
+   }
+   return exceeded;
+}
+
+/* DSCP of a packet remarked by an OFPMBT_DSCP_REMARK band: the drop
+ * precedence of the AF classes goes up by prec_level, up to the
+ * highest one. Other code points are left alone. */
+uint8_t
+ofp_meter_dscp_remark (uint8_t dscp, uint8_t prec_level)
+{
+   uint8_t af_class = dscp >> 3;
+   uint8_t drop = (dscp >> 1) & 3;
+
+   if (af_class < 1 || af_class > 4 || !drop || (dscp & 1))
+      return dscp;
+   drop = (drop + prec_level > 3) ? 3 : drop + prec_level;
+   return (af_class << 3) | (drop << 1);
+}
+
+/* Sum the per core shards of the counters of a meter into 'stats' and
+ * the band stats after it, in meter_mod order and network byte order.
+ * The counters of bands replaced by a meter modify, folded in or still
+ * in their grace period, are counted with the band at the same place.
+ * Only run for stats requests and exports, the datapath never waits
+ * for it. */
+void
+ofp_meter_stats_collect (struct openflow_meter_entry *meter_entry,
+                         struct ofp_meter_stats *stats, long long int now)
+{
+   struct ofp_meter_bands *bands = meter_entry->bands, *retired;
+   struct ofp_meter_band_count count;
+   uint64_t packets = 0, bytes = 0;
+   long long int duration = now - meter_entry->created;
+   uint32_t core;
+   uint16_t i;
+
+   for (core=0;core<OFP_METER_MAX_CORES;core++) {
+      packets += __atomic_load_n (&meter_entry->shards[core].packet_in_count, __ATOMIC_RELAXED);
+      bytes += __atomic_load_n (&meter_entry->shards[core].byte_in_count, __ATOMIC_RELAXED);
+   }
+   stats->meter_id = htonl (meter_entry->meter_id);
+   stats->len = htons (sizeof(struct ofp_meter_stats) +
+                       bands->n_bands * sizeof(struct ofp_meter_band_stats));
+   stats->flow_count = htonl (meter_entry->flow_count);
+   stats->packet_in_count = htonl_64 (packets);
+   stats->byte_in_count = htonl_64 (bytes);
+   stats->duration_sec = htonl (duration / 1000);
+   stats->duration_nsec = htonl ((duration % 1000) * 1000000);
+   for (i=0;i<bands->n_bands;i++) {
+      count = meter_entry->band_base[i];
+      ofp_meter_band_counts (&bands->band[i], &count);
+      for (retired = ofp_meter_retired_bands; retired; retired = retired->retired_next) {
+         if (retired->owner == meter_entry && i < retired->n_bands)
+            ofp_meter_band_counts (&retired->band[i], &count);
+      }
+      stats->band_stats[i].packet_band_count = htonl_64 (count.packet_band_count);
+      stats->band_stats[i].byte_band_count = htonl_64 (count.byte_band_count);
+   }
+}
+
+uint8_t
+process_meter_modify_add_message (struct ofp_conn *connection, uint32_t xid, struct ofp_meter_mod *meter_modify_msg)
+{
+   struct openflow_meter_table *meter_table = ofp_switch.meter_table;
+   struct openflow_meter_entry *meter_entry = NULL;
+   struct ofp_meter_bands *bands;
+   uint32_t meter_id = ntohl(meter_modify_msg->meter_id);
+   uint32_t error;
+
+   if (meter_id == 0 || meter_id > OFPM_MAX) {
+     send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_INVALID_METER);
+     return  0;
+   }
 
    if (IS_METER_ALREADY_EXISTS(meter_id)) {
      send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_METER_EXISTS);
      return  0;
    }
 
-   if (ofp_switch.meter_table->total_meter_count > OFPM_MAX) {
+   if (meter_table->total_meter_count > OFPM_MAX ||
+       (meter_id >= OFP_METER_DENSE_MAX && ofp_id_index_reserve (&meter_table->index))) {
      send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_METERS);
      return  0;
    }
 
+   error = ofp_meter_compile (meter_modify_msg, &bands);
+   if (error) {
+     send_error_message(connection, xid, OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+     return  0;
+   }
+
    meter_entry = malloc (sizeof (struct openflow_meter_entry));
+   if (!meter_entry) {
+     free (bands);
+     send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_METERS);
+     return  0;
+   }
+   memset(meter_entry,0,sizeof(struct openflow_meter_entry));
+   if (posix_memalign ((void **) &meter_entry->shards, 64,
+                       OFP_METER_MAX_CORES * sizeof(struct ofp_meter_shard))) {
+     free (bands);
+     free (meter_entry);
+     send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_METERS);
+     return  0;
+   }
+   memset(meter_entry->shards,0,OFP_METER_MAX_CORES * sizeof(struct ofp_meter_shard));
    meter_entry->meter_id = meter_id;
-   tmp_meter_entry = ofp_switch.meter_table->meter_entry;
-   while (tmp_meter_entry) {
-     position_to_insert = tmp_meter_entry; 
-     tmp_meter_entry = tmp_meter_entry->list_node.next;
-   }
-   position_to_insert->list_node.next = meter_entry;
-   meter_entry->list_node.prev = position_to_insert;
-
-   for (i=0;i<no_of_bands;i++) {
-     bands = malloc (sizeof (struct ofp_switch_meter_band));
-     msg_band = &meter_modify_msg->bands[i];
-     bands->type = msg_band->type;
-     bands->len = msg_band->len;
-     bands->rate = ntohl(msg_band->rate);
-     bands->burst_size = ntohl(msg_band->burst_size);
-     if (bands->type == OFPMBT_DSCP_REMARK) {
-        struct ofp_meter_band_dscp_remark *msg_band_dsc = (struct ofp_meter_band_dscp_remark *) 
-               (msg_band + sizeof(struct ofp_meter_band_header));
-        bands->band_specific_date.prec_level = nthos(msg_band_dsc->prec_level);
-     }
-     if (i==0)
-        meter_entry->band_list = bands;
-     else {
-        bands->list_node.prev = prev_band;
-        prev_band->list_node.next = bands;
-     }
-     prev_band = bands;
+   meter_entry->flags = ntohs(meter_modify_msg->flags);
+   meter_entry->created = time_msec ();
+   meter_entry->bands = bands;
+   ofp_entry_list_append (&meter_table->meters, meter_entry);
+   if (meter_id < OFP_METER_DENSE_MAX) {
+     meter_table->dense[meter_id] = meter_entry;
+   }
+   else {
+     ofp_id_index_link (&meter_table->index, meter_entry);
    }
+   meter_table->total_meter_count++;
    return 0;
 }
 
-uint8_t
-ofp_delete_meter (struct openflow_meter_entry *meter_entry)
+/* Remove the flows with a meter instruction to 'meter_id', or to any
+ * meter for OFPM_ALL. Only done on meter delete, so walking the tables
+ * is fine. */
+static void
+ofp_meter_remove_flows (uint32_t meter_id)
 {
-   uint16_t i,j;
-   uint16_t no_of_bands = 0;
-   uint16_t no_of_actions = 0;
-   struct ofp_switch_meter_band *band = meter_entry->band_list;
-   struct ofp_switch_meter_band *next_band = NULL;
-   for (i=0;i<no_of_bands;i++) {
-      next_band = band->list_node.next;
-      free (band);
-      band = next_band;
+   struct openflow_table *table;
+   struct ofp_flow_match match;
+   struct openflow_entry *entry;
+   uint32_t i, t;
+
+   memset (&match, 0, sizeof match);
+   for (t=0;t<ofp_switch.features.n_tables;t++) {
+      table = &ofp_switch.features.tables[t];
+      if (ofp_flow_table_select (table, &match)) {
+         printf("ERROR removing the flows of meter %u\n", meter_id);
+         continue;
+      }
+      for (i=0;i<ofp_flow_selection.n;i++) {
+         entry = ofp_flow_selection.entries[i];
+         if (entry->meter_id && (meter_id == OFPM_ALL || entry->meter_id == meter_id))
+            ofp_flow_remove (table, entry, OFPRR_METER_DELETE);
+      }
    }
-   return 0;
+}
+
+static void
+ofp_meter_remove (struct openflow_meter_table *meter_table,
+                  struct openflow_meter_entry *meter_entry)
+{
+   ofp_entry_list_remove (&meter_table->meters, meter_entry);
+   if (meter_entry->meter_id < OFP_METER_DENSE_MAX) {
+      meter_table->dense[meter_entry->meter_id] = NULL;
+   }
+   else {
+      ofp_id_index_unlink (&meter_table->index, meter_entry);
+   }
+   meter_table->total_meter_count--;
+   ofp_delete_meter (meter_entry);
 }
 
 uint8_t
 process_meter_add_modify_del_message (struct ofp_conn *connection, uint32_t xid, struct ofp_meter_mod *meter_modify_msg)
 {
+   struct openflow_meter_table *meter_table = ofp_switch.meter_table;
    struct openflow_meter_entry *meter_entry = NULL;
-   struct openflow_meter_entry *prev_meter_entry = NULL;
-   struct openflow_meter_entry *next_meter_entry = NULL;
-   bool delete_all = FALSE;
    uint32_t meter_id;
 
    meter_id = ntohl (meter_modify_msg->meter_id); 
 
-   if (!IS_GROUP_ALREADY_EXISTS(meter_id)) {
-     return  0;
-   }
-   else if (meter_id == OFPG_ALL) {
-     delete_all = TRUE;
-   }
-   meter_entry = ofp_switch.meter_table->meter_entry;
-   while (meter_entry) {
-     next_meter_entry = meter_entry->list_node.next;
-     if ((meter_entry->meter_id == meter_id) || (delete_all)) {
-        if (next_meter_entry)
-           next_meter_entry->list_node.prev = meter_entry->list_node.prev;
-        if (prev_meter_entry) 
-          prev_meter_entry->list_node.next = meter_entry->list_node.next;
-        ofp_delete_meter (meter_entry);
-        free (meter_entry);
-     }
-     prev_meter_entry = meter_entry;
-     meter_entry = meter_entry->list_node.next;
+   if (meter_id == OFPM_ALL) {
+     ofp_meter_remove_flows (OFPM_ALL);
+     while (meter_table->meters.first)
+        ofp_meter_remove (meter_table, ofp_entry_list_first (&meter_table->meters));
+     return 0;
    }
+
+   /* Deleting a meter which does not exist is not an error */
+   meter_entry = ofp_meter_find (meter_table, meter_id);
+   if (!meter_entry)
+     return 0;
+   if (meter_entry->flow_count)
+     ofp_meter_remove_flows (meter_id);
+   ofp_meter_remove (meter_table, meter_entry);
    return 0;
 }
 
 uint8_t
-process_meter_mod_modify_mod_message (struct ofp_conn *connection, uint32_t xid, struct ofp_meter_mod *meter_modify_msg)
+process_meter_add_modify_mod_message (struct ofp_conn *connection, uint32_t xid, struct ofp_meter_mod *meter_modify_msg)
 {
-   uint16_t i,j;
-   uint16_t no_of_bucket = 0;
-   uint16_t no_of_actions = 0;
    struct openflow_meter_entry *meter_entry = NULL;
-   bool delete_all = FALSE;
-   uint32_t meter_id;
+   struct ofp_meter_bands *bands;
+   uint32_t meter_id, error;
+   uint16_t i;
 
    meter_id = ntohl (meter_modify_msg->meter_id); 
 
-   if (!IS_METER_ALREADY_EXISTS(meter_id)) {
+   meter_entry = ofp_meter_find (ofp_switch.meter_table, meter_id);
+   if (!meter_entry) {
      send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_UNKNOWN_METER);
      return  0;
    }
 
-   meter_entry = ofp_switch.meter_table->meter_entry;
-   while (meter_entry) {
-     if (meter_entry->meter_id == meter_id) {
-        ofp_delete_meter (meter_entry);
-        process_group_modify_add_message (connection, xid, meter_modify_msg);
-     }
-     else {
-        meter_entry = meter_entry->list_node.next;
-     }
+   error = ofp_meter_compile (meter_modify_msg, &bands);
+   if (error) {
+     send_error_message(connection, xid, OFP_ERROR_TYPE(error), OFP_ERROR_CODE(error));
+     return  0;
    }
+
+   /* Same entry, new flags and bands: the new block is complete before
+    * the datapath can see it, and the old one waits for the cores which
+    * may still be metering with it */
+   meter_entry->flags = bands->flags;
+   for (i=bands->n_bands;i<OFP_METER_MAX_BANDS;i++)
+      memset (&meter_entry->band_base[i], 0, sizeof(struct ofp_meter_band_count));
+   ofp_meter_bands_retire (__atomic_exchange_n (&meter_entry->bands, bands, __ATOMIC_SEQ_CST),
+                           meter_entry);
    return 0;
 }
 
@@ -921,8 +4528,18 @@ uint8_t
 process_meter_modify_message (struct ofp_conn *connection, char *buf)
 {
    struct ofp_meter_mod *meter_modify_msg = (struct ofp_meter_mod *) (buf);
-   uint8_t command = ntohs(meter_modify_msg->command);
-   uint32_t xid = htonl(0);
+   uint16_t command = ntohs(meter_modify_msg->command);
+   uint32_t xid = ntohl (meter_modify_msg->header.xid);
+
+   if (!ofp_switch.meter_table) {
+     ofp_switch.meter_table = calloc (1, sizeof(struct openflow_meter_table));
+     if (!ofp_switch.meter_table) {
+       send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_OUT_OF_METERS);
+       return 0;
+     }
+     ofp_switch.meter_table->meters.node_offset = offsetof(struct openflow_meter_entry, list_node);
+     ofp_switch.meter_table->index.id_offset = offsetof(struct openflow_meter_entry, meter_id);
+   }
 
    if (command == OFPMC_ADD)
      return process_meter_modify_add_message (connection, xid, meter_modify_msg);
@@ -931,9 +4548,498 @@ process_meter_modify_message (struct ofp_conn *connection, char *buf)
    else if (command == OFPMC_DELETE)
      return process_meter_add_modify_del_message (connection, xid, meter_modify_msg);
    else
-     send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_INVALID_METER);
+     send_error_message(connection, xid, OFPET_METER_MOD_FAILED, OFPMMFC_BAD_COMMAND);
+
+   return 0;
+}
+
+/* OFPMP_METER reply: the stats of one meter or of all of them, split
+ * over as many OFPMPF_REPLY_MORE messages as needed */
+static uint8_t
+process_meter_stats_request (struct ofp_conn *connection, uint32_t xid,
+                             struct ofp_meter_multipart_request *request)
+{
+   struct openflow_meter_table *meter_table = ofp_switch.meter_table;
+   struct openflow_meter_entry *meter_entry;
+   struct ofp_multipart_reply *reply;
+   uint32_t meter_id = ntohl (request->meter_id);
+   uint16_t len = sizeof(struct ofp_multipart_reply), stats_len;
+   long long int now = time_msec ();
+   char *buf;
+
+   if (meter_id == OFPM_ALL)
+      meter_entry = meter_table ? ofp_entry_list_first (&meter_table->meters) : NULL;
+   else {
+      meter_entry = ofp_meter_find (meter_table, meter_id);
+      if (!meter_entry)
+         return send_error_message (connection, xid, OFPET_METER_MOD_FAILED,
+                                    OFPMMFC_UNKNOWN_METER);
+   }
+
+   buf = ofp_buf_alloc (OFP_MULTIPART_REPLY_MAX);
+   if (!buf)
+      return 1;
+   for (; meter_entry; meter_entry = (meter_id == OFPM_ALL) ?
+                                     ofp_meter_next (meter_entry) : NULL) {
+      stats_len = sizeof(struct ofp_meter_stats) +
+                  meter_entry->bands->n_bands * sizeof(struct ofp_meter_band_stats);
+      if (len + stats_len > OFP_MULTIPART_REPLY_MAX) {
+         reply = (struct ofp_multipart_reply *) buf;
+         memset (reply, 0, sizeof(struct ofp_multipart_reply));
+         reply->type = htons (OFPMP_METER);
+         reply->flags = htons (OFPMPF_REPLY_MORE);
+         if (send_openflow_message (connection, len - sizeof(struct ofp_header),
+                                    OFPT_MULTIPART_REPLY, xid, buf))
+            return 1;
+         buf = ofp_buf_alloc (OFP_MULTIPART_REPLY_MAX);
+         if (!buf)
+            return 1;
+         len = sizeof(struct ofp_multipart_reply);
+      }
+      memset (buf + len, 0, stats_len);
+      ofp_meter_stats_collect (meter_entry, (struct ofp_meter_stats *) (buf + len), now);
+      len += stats_len;
+   }
+   reply = (struct ofp_multipart_reply *) buf;
+   memset (reply, 0, sizeof(struct ofp_multipart_reply));
+   reply->type = htons (OFPMP_METER);
+   return send_openflow_message (connection, len - sizeof(struct ofp_header),
+                                 OFPT_MULTIPART_REPLY, xid, buf);
+}
+
+uint8_t
+process_multipart_request (struct ofp_conn *connection, char *buf)
+{
+   struct ofp_multipart_request *request = (struct ofp_multipart_request *) buf;
+   uint16_t len = ntohs (request->header.length) - sizeof(struct ofp_multipart_request);
+   uint32_t xid = ntohl (request->header.xid);
+
+   switch (ntohs (request->type)) {
+   case OFPMP_METER:
+      if (len < sizeof(struct ofp_meter_multipart_request))
+         return send_error_message (connection, xid, OFPET_BAD_REQUEST, OFPBRC_BAD_LEN);
+      return process_meter_stats_request (connection, xid,
+                                          (struct ofp_meter_multipart_request *) request->body);
+   default:
+      return send_error_message (connection, xid, OFPET_BAD_REQUEST, OFPBRC_BAD_MULTIPART);
+   }
+}
+
+/* Symmetric messages which need no action from the switch */
+static uint8_t
+ofp_ignore_message (struct ofp_conn *connection, char *buf)
+{
+   (void) connection;
+   (void) buf;
+   return 0;
+}
+
+/* Receive dispatch table indexed by ofp_type. Types without a handler
+ * are the ones a controller never sends to a switch. */
+static struct ofp_msg_handler ofp_msg_handlers[OFPT_BUNDLE_ADD_MESSAGE + 1] = {
+   [OFPT_HELLO] = { "HELLO", ofp_ignore_message, sizeof(struct ofp_header), TRUE },
+   [OFPT_ERROR] = { "ERROR", ofp_ignore_message, sizeof(struct ofp_error_msg) },
+   [OFPT_ECHO_REQUEST] = { "ECHO_REQUEST", process_echo_request, sizeof(struct ofp_header) },
+   [OFPT_ECHO_REPLY] = { "ECHO_REPLY", ofp_ignore_message, sizeof(struct ofp_header) },
+   [OFPT_FEATURES_REQUEST] = { "FEATURES_REQUEST", process_features_request_message,
+                               sizeof(struct ofp_header) },
+   [OFPT_GET_CONFIG_REQUEST] = { "GET_CONFIG_REQUEST", process_get_config_message,
+                                 sizeof(struct ofp_header) },
+   [OFPT_SET_CONFIG] = { "SET_CONFIG", process_set_config_message, sizeof(struct ofp_switch_config) },
+   [OFPT_PACKET_OUT] = { "PACKET_OUT", process_packet_out_message, sizeof(struct ofp_packet_out) },
+   [OFPT_FLOW_MOD] = { "FLOW_MOD", process_flow_modify_message, sizeof(struct ofp_flow_mod) },
+   [OFPT_GROUP_MOD] = { "GROUP_MOD", process_group_modify_message, sizeof(struct ofp_group_mod) },
+   [OFPT_TABLE_MOD] = { "TABLE_MOD", process_table_modify_message, sizeof(struct ofp_table_mod) },
+   [OFPT_BARRIER_REQUEST] = { "BARRIER_REQUEST", process_barrier_request_message,
+                              sizeof(struct ofp_header) },
+   [OFPT_ROLE_REQUEST] = { "ROLE_REQUEST", process_role_request_message,
+                           sizeof(struct ofp_role_request) },
+   [OFPT_GET_ASYNC_REQUEST] = { "GET_ASYNC_REQUEST", process_async_get_config_request,
+                                sizeof(struct ofp_header) },
+   [OFPT_SET_ASYNC] = { "SET_ASYNC", process_async_set_config_request,
+                        sizeof(struct ofp_async_config) },
+   [OFPT_MULTIPART_REQUEST] = { "MULTIPART_REQUEST", process_multipart_request,
+                                sizeof(struct ofp_multipart_request) },
+   [OFPT_METER_MOD] = { "METER_MOD", process_meter_modify_message, sizeof(struct ofp_meter_mod) },
+};
+
+/* Counters of one message type, NULL for types out of range */
+const struct ofp_msg_handler *
+ofp_msg_handler_stats (uint8_t type)
+{
+   if (type > OFPT_BUNDLE_ADD_MESSAGE)
+      return NULL;
+   return &ofp_msg_handlers[type];
+}
+
+/* Validate one complete message and hand it to the process_* handler of
+ * its type. The reassembler guarantees that ofp_header.length equals
+ * msg->length, so handlers can trust the header length of their buffer
+ * once it is at least the min_len of the table. */
+uint8_t
+ofp_handle_message (struct ofp_conn *connection, struct ofp_msg_view *msg)
+{
+   struct ofp_header *header = (struct ofp_header *) msg->data;
+   struct ofp_msg_handler *entry;
+   uint64_t start;
+   uint8_t ret;
+
+   if (header->type > OFPT_BUNDLE_ADD_MESSAGE ||
+       !ofp_msg_handlers[header->type].handler)
+      return send_error_message (connection, ntohl (header->xid), OFPET_BAD_REQUEST, OFPBRC_BAD_TYPE);
+
+   entry = &ofp_msg_handlers[header->type];
+   if (header->version != OFP14_VERSION && !entry->any_version) {
+      entry->n_errors++;
+      return send_error_message (connection, ntohl (header->xid), OFPET_BAD_REQUEST, OFPBRC_BAD_VERSION);
+   }
+   if (msg->length < entry->min_len) {
+      entry->n_errors++;
+      return send_error_message (connection, ntohl (header->xid), OFPET_BAD_REQUEST, OFPBRC_BAD_LEN);
+   }
+
+   start = ofp_cycles ();
+   ret = entry->handler (connection, msg->data);
+   entry->cycles += ofp_cycles () - start;
+   entry->n_msgs++;
+   entry->n_bytes += msg->length;
+   return ret;
+}
+
+static uint8_t
+ofp_rx_ring_init (struct ofp_rx_ring *ring)
+{
+   memset(ring,0,sizeof(struct ofp_rx_ring));
+   ring->data = malloc (OFP_RX_RING_SIZE);
+   return ring->data == NULL;
+}
+
+static void
+ofp_rx_ring_destroy (struct ofp_rx_ring *ring)
+{
+   free (ring->data);
+   free (ring->linear);
+}
+
+/* Copy 'len' bytes starting at ring position 'pos' into 'dst' */
+static void
+ofp_rx_ring_copy (struct ofp_rx_ring *ring, uint32_t pos, void *dst, uint32_t len)
+{
+   uint32_t offset = pos & OFP_RX_RING_MASK;
+   uint32_t first = OFP_RX_RING_SIZE - offset;
+
+   if (first >= len) {
+      memcpy (dst, ring->data + offset, len);
+   }
+   else {
+      memcpy (dst, ring->data + offset, first);
+      memcpy ((char *) dst + first, ring->data, len - first);
+   }
+}
+
+/* Carve the next complete message out of the ring. The view points
+ * into the ring itself unless the message wraps around its end, in which
+ * case (at most once per lap) it is linearized into ring->linear.
+ * Returns 0 when no complete message is buffered, -1 on a corrupt
+ * length and 1 when 'msg' is filled. */
+static int
+ofp_rx_ring_next (struct ofp_rx_ring *ring, struct ofp_msg_view *msg)
+{
+   struct ofp_header header;
+   uint32_t used = ring->tail - ring->head;
+   uint32_t offset = ring->head & OFP_RX_RING_MASK;
+   uint16_t length;
+
+   if (used < sizeof(struct ofp_header))
+      return 0;
+   ofp_rx_ring_copy (ring, ring->head, &header, sizeof(struct ofp_header));
+   length = ntohs (header.length);
+   if (length < sizeof(struct ofp_header))
+      return -1;
+   if (used < length)
+      return 0;
+
+   if (offset + length <= OFP_RX_RING_SIZE) {
+      msg->data = ring->data + offset;
+   }
+   else {
+      if (!ring->linear && !(ring->linear = malloc (OFP_MAX_MSG_LEN)))
+         return -1;
+      ofp_rx_ring_copy (ring, ring->head, ring->linear, length);
+      msg->data = ring->linear;
+   }
+   msg->length = length;
+   return 1;
+}
+
+/* Read what the socket has without blocking and dispatch every complete
+ * message straight out of the receive ring. One read takes up to
+ * OFP_RX_READ_SIZE bytes, however many messages (or pieces of messages)
+ * that is. Returns non-zero when the connection has to be closed. */
+static uint8_t
+ofp_conn_read (struct ofp_conn *connection)
+{
+   struct ofp_rx_ring *ring = &connection->rx_ring;
+   struct ofp_msg_view msg;
+   struct iovec iov[2];
+   uint32_t budget = OFP_REACTOR_READ_BUDGET;
+   uint32_t space, offset, first;
+   int iovcnt, ret;
+   ssize_t n;
+
+   connection->read_pending = FALSE;
+   for (;;) {
+      /* Free space of the ring, split where it wraps */
+      space = OFP_RX_RING_SIZE - (ring->tail - ring->head);
+      if (space > OFP_RX_READ_SIZE)
+         space = OFP_RX_READ_SIZE;
+      offset = ring->tail & OFP_RX_RING_MASK;
+      first = OFP_RX_RING_SIZE - offset;
+      iov[0].iov_base = ring->data + offset;
+      if (first >= space) {
+         iov[0].iov_len = space;
+         iovcnt = 1;
+      }
+      else {
+         iov[0].iov_len = first;
+         iov[1].iov_base = ring->data;
+         iov[1].iov_len = space - first;
+         iovcnt = 2;
+      }
+
+      n = readv (connection->sock_fd, iov, iovcnt);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         printf("ERROR reading from socket\n");
+         return 1;
+      }
+      if (n == 0)
+         return 1; /* controller closed the connection */
+      ring->tail += n;
+
+      while ((ret = ofp_rx_ring_next (ring, &msg)) > 0) {
+         ofp_handle_message (connection, &msg);
+         ring->head += msg.length;
+      }
+      if (ret < 0)
+         return 1; /* the stream is out of sync */
+
+      if (budget <= (uint32_t) n) {
+         /* Edge triggered: nothing tells us again that data is left,
+          * so remember to come back in the next cycle */
+         connection->read_pending = TRUE;
+         return 0;
+      }
+      budget -= n;
+   }
+}
 
+uint8_t
+ofp_reactor_init (struct ofp_reactor *reactor)
+{
+   memset(reactor,0,sizeof(struct ofp_reactor));
+   reactor->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+   if (reactor->epoll_fd < 0) {
+      printf("ERROR creating epoll instance\n");
+      return 1;
+   }
    return 0;
 }
 
+/* Take ownership of a connected controller socket. The socket is made
+ * non-blocking and watched for both input and write readiness. */
+struct ofp_conn *
+ofp_reactor_add_conn (struct ofp_reactor *reactor, int sock_fd,
+                      uint16_t connection_id)
+{
+   struct ofp_conn *connection;
+   struct ofp_conn **conns;
+   struct epoll_event event;
+   int flags;
+
+   if (reactor->n_conns == reactor->max_conns) {
+      uint32_t max_conns = reactor->max_conns ? reactor->max_conns * 2 : 16;
+      conns = realloc (reactor->conns, max_conns * sizeof(struct ofp_conn *));
+      if (!conns)
+         return NULL;
+      reactor->conns = conns;
+      conns = realloc (reactor->active, max_conns * sizeof(struct ofp_conn *));
+      if (!conns)
+         return NULL;
+      reactor->active = conns;
+      reactor->max_conns = max_conns;
+   }
+
+   flags = fcntl (sock_fd, F_GETFL, 0);
+   if (flags < 0 || fcntl (sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      printf("ERROR setting socket non-blocking\n");
+      return NULL;
+   }
+
+   connection = malloc (sizeof(struct ofp_conn));
+   if (!connection) {
+      printf("ERROR allocating the connection\n");
+      return NULL;
+   }
+   memset(connection,0,sizeof(struct ofp_conn));
+   connection->sock_fd = sock_fd;
+   connection->connection_id = connection_id;
+   connection->role = OFPCR_ROLE_EQUAL;
+   connection->miss_send_len = 128; /* default value */
+   if (ofp_rx_ring_init (&connection->rx_ring)) {
+      free (connection);
+      return NULL;
+   }
+   if (ofp_pin_limiter_init (&connection->pin_limiter)) {
+      ofp_rx_ring_destroy (&connection->rx_ring);
+      free (connection);
+      return NULL;
+   }
+
+   memset(&event,0,sizeof(struct epoll_event));
+   event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   event.data.ptr = connection;
+   if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) < 0) {
+      printf("ERROR adding socket to epoll\n");
+      ofp_pin_purge (connection);
+      ofp_rx_ring_destroy (&connection->rx_ring);
+      free (connection);
+      return NULL;
+   }
+
+   connection->reactor_index = reactor->n_conns;
+   reactor->conns[reactor->n_conns++] = connection;
+   ofp_ctrl_registry_add (connection);
+   send_hello_message (connection);
+   return connection;
+}
+
+/* Close the connection and release everything it owns */
+void
+ofp_reactor_del_conn (struct ofp_reactor *reactor, struct ofp_conn *connection)
+{
+   struct ofp_conn *last;
+   uint32_t i;
+
+   epoll_ctl (reactor->epoll_fd, EPOLL_CTL_DEL, connection->sock_fd, NULL);
+   close (connection->sock_fd);
+
+   last = reactor->conns[--reactor->n_conns];
+   reactor->conns[connection->reactor_index] = last;
+   last->reactor_index = connection->reactor_index;
+
+   if (connection->active) {
+      for (i=0;i<reactor->n_active;i++) {
+         if (reactor->active[i] == connection) {
+            reactor->active[i] = reactor->active[--reactor->n_active];
+            break;
+         }
+      }
+   }
+
+   ofp_ctrl_registry_del (connection);
+   ofp_pin_purge (connection);
+   ofp_out_queue_purge (&connection->out_queue);
+   ofp_rx_ring_destroy (&connection->rx_ring);
+   free (connection);
+}
+
+/* One dispatch cycle: wait for socket events, read and process every
+ * readable connection, then flush what the cycle queued. Only the
+ * connections with events (or unread data left from the previous cycle)
+ * are visited, replies are coalesced per connection and a controller
+ * which does not drain its socket only keeps its own messages queued. */
+uint8_t
+ofp_reactor_run_once (struct ofp_reactor *reactor, int timeout_msec)
+{
+   struct epoll_event events[OFP_REACTOR_MAX_EVENTS];
+   struct ofp_conn *connection;
+   uint32_t i, kept = 0;
+   long long int now;
+   int n;
+
+   /* Connections with unread data must not wait for a new edge */
+   if (reactor->n_active)
+      timeout_msec = 0;
+
+   /* Wake up in time for the flow timeouts */
+   if (ofp_flow_timers.n_timers &&
+       (timeout_msec < 0 || timeout_msec > OFP_TIMER_TICK_MSEC))
+      timeout_msec = OFP_TIMER_TICK_MSEC;
+   /* and for the queued packet-ins */
+   if (ofp_pin_n_queued &&
+       (timeout_msec < 0 || timeout_msec > OFP_PIN_DRAIN_MSEC))
+      timeout_msec = OFP_PIN_DRAIN_MSEC;
+   /* and for the meter memory waiting for its grace period */
+   if ((ofp_meter_retired_bands || ofp_meter_retired) &&
+       (timeout_msec < 0 || timeout_msec > OFP_METER_RECLAIM_MSEC))
+      timeout_msec = OFP_METER_RECLAIM_MSEC;
 
+   n = epoll_wait (reactor->epoll_fd, events, OFP_REACTOR_MAX_EVENTS, timeout_msec);
+   if (n < 0) {
+      if (errno == EINTR)
+         return 0;
+      printf("ERROR waiting for socket events\n");
+      return 1;
+   }
+   now = time_msec ();
+   if (ofp_flow_timers.n_timers)
+      ofp_flow_timers_run (now);
+   ofp_meter_clock_sync (now);
+   ofp_meter_reclaim ();
+   ofp_pkt_bufs_expire (now);
+   for (i=0;ofp_pin_n_queued && i<reactor->n_conns;i++) {
+      if (!reactor->conns[i]->closing)
+         ofp_pin_drain (reactor->conns[i], now);
+   }
+
+   for (i=0;i<(uint32_t) n;i++) {
+      connection = events[i].data.ptr;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+         connection->closing = TRUE;
+      if (events[i].events & EPOLLOUT)
+         connection->write_blocked = FALSE;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+         connection->read_pending = TRUE;
+      ofp_reactor_activate (reactor, connection);
+   }
+
+   /* A connection stays marked active while it is served, so that it is
+    * not queued a second time if it fails while sending */
+   for (i=0;i<reactor->n_active;i++) {
+      connection = reactor->active[i];
+      if (!connection->closing && connection->read_pending) {
+         ofp_conn_batch_begin (connection);
+         if (ofp_conn_read (connection))
+            connection->closing = TRUE;
+      }
+      connection->batching = FALSE;
+      if (!connection->closing && connection->out_queue.count &&
+          !connection->write_blocked && ofp_conn_flush (connection))
+         connection->closing = TRUE;
+
+      connection->active = FALSE;
+      if (connection->closing) {
+         ofp_reactor_del_conn (reactor, connection);
+         continue;
+      }
+      if (connection->read_pending) {
+         connection->active = TRUE;
+         reactor->active[kept++] = connection;
+      }
+   }
+   reactor->n_active = kept;
+   return 0;
+}
+
+void
+ofp_reactor_run (struct ofp_reactor *reactor)
+{
+   while (!reactor->stop) {
+      if (ofp_reactor_run_once (reactor, -1))
+         break;
+   }
+}
@@ -2,6 +2,68 @@
 #ifndef OPENFLOW_H 
 #define OPENFLOW_H 
 #include "openflow_messages.h"
+#include "openflow_macro.h"
+
+/* Match fields of a flow or of a packet. Every field is kept in network
+ * byte order, as in the OXM TLV and in the packet, and the struct is a
+ * whole number of 64-bit words so that keys are masked, hashed and
+ * compared a word at a time. Keys are always zeroed before use. */
+struct ofp_flow_key {
+   uint64_t metadata;
+   uint32_t in_port;
+   uint32_t in_phy_port;
+   uint8_t eth_dst[ETHHDR_ADDR_LEN];
+   uint8_t eth_src[ETHHDR_ADDR_LEN];
+   uint16_t eth_type;
+   uint16_t vlan_vid;
+   uint8_t vlan_pcp;
+   uint8_t ip_dscp;
+   uint8_t ip_ecn;
+   uint8_t ip_proto;
+   uint32_t ipv4_src;
+   uint32_t ipv4_dst;
+   uint16_t tp_src;      /* TCP, UDP or SCTP source port */
+   uint16_t tp_dst;
+   uint8_t icmp_type;
+   uint8_t icmp_code;
+   uint16_t arp_op;
+   uint32_t arp_spa;
+   uint32_t arp_tpa;
+   uint32_t mpls_label;
+   uint8_t mpls_tc;
+   uint8_t pad[7];
+};
+#define OFP_FLOW_KEY_WORDS (sizeof(struct ofp_flow_key) / sizeof(uint64_t))
+
+/* Normalized form of an ofp_match: the mask has all ones for exact
+ * fields, the OXM mask for masked ones and zero for wildcards, and the
+ * key is already masked. */
+struct ofp_flow_match {
+   struct ofp_flow_key key;
+   struct ofp_flow_key mask;
+};
+
+/* Hash index of flow entries, chained through openflow_entry.hash_next */
+struct ofp_flow_hmap {
+   struct openflow_entry **buckets;
+   uint32_t mask;        /* number of buckets - 1 */
+   uint32_t n;
+};
+
+/* Tuple space search: the flows of a table sharing the same mask are
+ * kept in one subtable, hashed on the masked words of their key only.
+ * A lookup probes each subtable once, highest max_priority first, and
+ * stops as soon as no remaining subtable can beat the current match. */
+struct ofp_flow_subtable {
+   struct ofp_flow_key mask;
+   uint32_t mask_hash;
+   uint8_t n_words;                     /* words of the key the mask uses */
+   uint8_t words[OFP_FLOW_KEY_WORDS];
+   uint16_t max_priority;
+   uint32_t max_count;                  /* flows at max_priority */
+   uint32_t n_flows;
+   struct ofp_flow_hmap flows;
+};
 
 struct openflow_table { 
    char *name;
@@ -10,6 +72,16 @@ struct openflow_table {
    uint8_t vacancy_down;
    uint8_t vacancy_up;
    uint8_t vacancy;
+   uint8_t vacancy_next; /* OFPTR_VACANCY_DOWN or _UP, the only event
+                          * allowed next */
+   uint8_t table_id;
+   uint32_t n_flows;
+   uint32_t max_flows;
+   uint32_t n_subtables;
+   uint32_t max_subtables;
+   struct ofp_flow_subtable **subtables; /* by decreasing max_priority */
+   uint32_t max_evict;
+   struct openflow_entry **evict_heap;   /* all flows, min evict_key first */
 };
 
 /* Switch features. */
@@ -30,19 +102,95 @@ struct switch_features {
 
 struct openflow_group_table  {
    uint32_t total_group_count;
-   struct openflow_group_entry *group_entry;
+   struct ofp_entry_list groups;                  /* in the order added */
+   struct ofp_id_index index;                     /* on group_id */
 };
 
 struct openflow_meter_table{
    uint32_t total_meter_count;
-   struct openflow_meter_entry *meter_entry;
+   struct ofp_entry_list meters;                  /* in the order added */
+   struct openflow_meter_entry *dense[OFP_METER_DENSE_MAX]; /* by meter_id */
+   struct ofp_id_index index;                     /* on meter_id, for the
+                                                   * bigger meter_ids */
+};
+
+/* Bucket of a group watching a port or another group */
+struct ofp_group_watch {
+   struct openflow_group_entry *group;
+   uint32_t bucket;
+};
+
+struct ofp_watch_list {
+   uint32_t n;
+   uint32_t max;
+   struct ofp_group_watch *watches;
+};
+
+/* Packet kept by the switch for the controller, which refers to it by
+ * buffer_id: the slot index, tagged with the generation of the slot so
+ * that a stale buffer_id never gets a newer packet */
+struct ofp_pkt_buf {
+   uint32_t prev;            /* used slots by store time, or free list */
+   uint32_t next;
+   uint16_t generation;
+   uint16_t len;
+   bool used;
+   uint32_t in_port;
+   long long int stored;     /* msec */
+};
+
+/* Output path of the datapath: applies an action list to a frame which
+ * came in on in_port. An output to OFPP_TABLE runs it through the flow
+ * tables. */
+typedef void (*ofp_packet_output_cb) (const uint8_t *frame, uint16_t len,
+                                      uint32_t in_port,
+                                      const struct ofp_action_header *actions,
+                                      uint16_t actions_len);
+
+struct ofp_pkt_buf_pool {
+   uint32_t n;               /* switch_features.n_buffers */
+   uint32_t n_used;
+   uint32_t free_head;
+   uint32_t oldest;          /* first to age out or to be reused */
+   uint32_t newest;
+   struct ofp_pkt_buf *bufs;
+   uint8_t *frames;          /* n frames of OFP_PKT_BUF_FRAME_MAX bytes */
 };
 
 struct openflow_switch {
    struct switch_features features;
    enum ofp_config_flags config_flag;
+   uint32_t reply_gen;   /* bumped by ofp_switch_config_changed */
    struct openflow_group_table *group_table;
    struct openflow_meter_table *meter_table;
+   uint64_t port_live[OFP_PORT_LIVE_MAX / 64]; /* bit per live port_no */
+   struct ofp_watch_list *port_watchers;      /* by port_no */
+};
+
+/* Length of the hello sent by the switch: header plus one version
+ * bitmap element carrying a single bitmap word. */
+#define OFP_HELLO_LEN (sizeof(struct ofp_hello) + \
+                       sizeof(struct ofp_hello_elem_versionbitmap) + sizeof(uint32_t))
+
+/* Replies which only depend on switch state. They are encoded once and
+ * rebuilt when ofp_switch.reply_gen moves, so answering a request is a
+ * copy plus the header patch done by send_openflow_message. */
+struct ofp_reply_cache {
+   bool valid;
+   uint32_t gen;         /* ofp_switch.reply_gen the replies match */
+   struct ofp_switch_features features_reply;
+   struct ofp_switch_config config_reply;
+   char hello[OFP_HELLO_LEN];
+};
+
+/* A flow forwarding to a group through a group action. The flow owns
+ * the array of its references, each one is also linked on the group so
+ * that deleting the group finds its flows without a table walk. */
+struct ofp_group_ref {
+   struct ofp_group_ref *next;
+   struct ofp_group_ref **pprev;
+   struct openflow_entry *flow;
+   struct openflow_group_entry *group;
 };
 
 struct openflow_entry {
@@ -61,6 +209,49 @@ struct openflow_entry {
    uint16_t importance;  /* Eviction precedence (optional). */
 
    struct ofp_match match; /* Description of fields. Variable size. */
+   struct ofp_flow_match flow_match; /* Normalized match, the table key */
+   uint32_t hash;                    /* hash of the key in its subtable */
+   struct openflow_entry *hash_next; /* next entry in the hash bucket */
+   uint16_t instructions_len;
+   struct ofp_instruction_header *instructions; /* copied from the flow_mod,
+                                                 * network byte order */
+   long long int last_used;          /* msec of the last packet hit */
+   struct ofp_timer timer;           /* next hard or idle deadline */
+   uint64_t evict_key;               /* lowest is evicted first */
+   uint32_t evict_index;             /* position in the table evict_heap */
+   uint16_t n_group_refs;
+   struct ofp_group_ref *group_refs; /* groups of its group actions */
+   uint32_t meter_id;                /* of its meter instruction, or 0 */
+};
+
+/* Microflow cache: exact packet keys mapped to the flow they resolved
+ * to (or to NULL for a table miss). An entry is only valid while its
+ * generation is the cache generation, which moves on every flow insert
+ * or removal, so invalidation is O(1). */
+struct ofp_microflow_entry {
+   struct ofp_flow_key key;
+   uint32_t hash;
+   uint32_t generation;
+   uint8_t table_id;
+   struct openflow_entry *flow;
+};
+
+struct ofp_microflow_set {
+   struct ofp_microflow_entry ways[OFP_MICROFLOW_WAYS];
+   uint8_t victim;       /* next way to evict, round robin */
+};
+
+struct ofp_microflow_stats {
+   uint64_t n_hits;
+   uint64_t n_misses;
+   uint64_t n_evictions;    /* live entries replaced by a miss */
+   uint64_t n_invalidations; /* generation bumps */
+};
+
+struct ofp_microflow_cache {
+   struct ofp_microflow_set *sets;
+   uint32_t generation;
+   struct ofp_microflow_stats stats;
 };
 
 union ofp_action {
@@ -76,23 +267,19 @@ union ofp_action {
     struct ofp_action_experimenter_header experimenter_header;
 };
 
-struct ofp_switch_acts{
-   struct list list_node;
-   struct ofp_action_header header;
-   union ofp_action action;
-};
-
-/* Bucket for use in groups. */
+/* Bucket for use in groups. The buckets of a group are an array, and
+ * their actions follow the array in the same allocation. */
 struct ofp_switch_bucket {
-    struct list list_node;
     uint16_t weight;            /* Relative weight, for "select" groups. */
+    uint16_t actions_len;       /* Bytes of actions. */
     uint32_t watch_port;      /* Port whose state affects whether this bucket
                                  * is live. Only required for fast failover
                                  * groups. */
     uint32_t watch_group;       /* Group whose state affects whether this
                                  * bucket is live. Only required for fast
                                  * failover groups. */
-    struct ofp_switch_acts *ofpacts_list;     /* Series of "struct ofpact"s. */
+    bool live;
+    struct ofp_action_header *actions; /* Packed, in wire format. */
 };
 
 struct openflow_group_entry {
@@ -100,26 +287,89 @@ struct openflow_group_entry {
     uint32_t group_id;
     enum ofp_group_type type; /* One of OFPGT_*. */
     uint32_t n_buckets;
-    struct ofp_switch_bucket *bucket_list;
+    struct ofp_switch_bucket *bucket_list; /* n_buckets buckets, the select
+                                            * table, then their actions */
+    uint16_t *select_lut;       /* OFPGT_SELECT: bucket of each hash slot,
+                                 * OFP_GROUP_NO_BUCKET if none is live */
+    bool live;                  /* some bucket is live */
+    uint16_t first_live;        /* OFPGT_FF bucket, OFP_GROUP_NO_BUCKET if
+                                 * none is live */
+    struct ofp_watch_list watchers; /* buckets watching this group */
+    uint32_t n_flow_refs;       /* flows forwarding to the group */
+    struct ofp_group_ref *flow_refs;
+    uint32_t n_group_refs;      /* bucket group actions forwarding to it */
+    uint32_t visit_gen;         /* loop check walk */
+    uint32_t watch_gen;         /* watch loop check walk */
 }
 
 union ofp_bands {
   uint8_t prec_level;
 };
+
+/* State of a band owned by one core, on its own cache line: the tokens
+ * it took from the shared bucket and spends on its own packets, and its
+ * share of the band counters */
+struct ofp_meter_credit {
+   int64_t tokens;
+   uint64_t packet_band_count;
+   uint64_t byte_band_count;
+} __attribute__((aligned(64)));
+
+/* Share of one core of the meter counters, only written by that core
+ * and summed up when the stats are asked for */
+struct ofp_meter_shard {
+   uint64_t packet_in_count;
+   uint64_t byte_in_count;
+} __attribute__((aligned(64)));
+
+/* Bands are token buckets counted in thousandths of a bit (OFPMF_KBPS)
+ * or of a packet (OFPMF_PKTPS), so that refills stay integer */
 struct ofp_switch_meter_band{
-   struct list list_node;
    uint16_t type;       /* One of OFPMBT_*. */
    uint16_t len;        /* Length in bytes of this band. */
    uint32_t rate;       /* Rate for this band. */
    uint32_t burst_size; /* Size of bursts. */
    union ofp_bands band_specific_date;
+   int64_t fill;        /* tokens added per msec */
+   int64_t capacity;    /* bucket depth, in tokens */
+   int64_t chunk;       /* tokens a core takes at once */
+   int64_t tokens;      /* shared bucket, atomic */
+   uint64_t last;       /* cycles of the last refill, atomic */
+   struct ofp_meter_credit *credits; /* OFP_METER_MAX_CORES */
+};
+
+/* Bands of a meter in one allocation: this header, the bands in the
+ * order of the meter_mod, then the per core credits of every band.
+ * Meter modify builds a new block and swaps the pointer, so the datapath
+ * always reads the flags, the band count and the bands of the same block. */
+struct ofp_meter_bands {
+   uint16_t flags;
+   uint16_t n_bands;
+   uint8_t by_rate[OFP_METER_MAX_BANDS]; /* band indexes by rising rate */
+   uint64_t retired_epoch;      /* grace period it waits for once replaced */
+   struct ofp_meter_bands *retired_next;
+   struct openflow_meter_entry *owner; /* meter whose counters it still
+                                        * holds, once replaced */
+   struct ofp_switch_meter_band band[0];
+};
+
+/* Band counters of the band blocks a meter modify replaced */
+struct ofp_meter_band_count {
+   uint64_t packet_band_count;
+   uint64_t byte_band_count;
 };
 
 struct openflow_meter_entry {
     struct list list_node;
     uint32_t meter_id;
     uint16_t flags;
-    struct ofp_switch_meter_band *band_list;
+    uint32_t flow_count;        /* flows with a meter instruction to it */
+    long long int created;      /* msec */
+    struct ofp_meter_shard *shards; /* OFP_METER_MAX_CORES */
+    struct ofp_meter_bands *bands;  /* atomic, swapped on meter modify */
+    struct ofp_meter_band_count band_base[OFP_METER_MAX_BANDS];
+    uint64_t retired_epoch;     /* grace period it waits for once deleted */
+    struct openflow_meter_entry *retired_next;
 }
 
 #endif
@@ -1,17 +1,186 @@
-
 #ifndef OPENFLOW_CONN_H
 #define OPENFLOW_CONN_H
+#include <sys/uio.h>
 #include "openflow_enum.h"
+
+/* Max number of encoded messages waiting in the output queue of a
+ * connection. */
+#define OFP_OUT_QUEUE_LEN 64
+/* Once this many bytes are queued the output queue is flushed even
+ * inside a batch. */
+#define OFP_OUT_QUEUE_FLUSH_BYTES (16 * 1024)
+
+/* Size of the receive ring of a connection, a power of two large
+ * enough for the biggest OpenFlow message plus one full read. */
+#define OFP_RX_RING_SIZE (128 * 1024)
+#define OFP_RX_RING_MASK (OFP_RX_RING_SIZE - 1)
+/* Max bytes asked from the socket by one read */
+#define OFP_RX_READ_SIZE (64 * 1024)
+/* Biggest message ofp_header.length can describe */
+#define OFP_MAX_MSG_LEN 0xffff
+
+/* Packet-in limiter of a connection: a token bucket per packet-in
+ * reason, in thousandths of a packet */
+#define OFP_PIN_N_REASONS (OFPR_PACKET_OUT + 1)
+#define OFP_PIN_RATE 1000      /* packet-ins per second and reason */
+#define OFP_PIN_BURST 200      /* packet-ins */
+/* Packet-ins over the rate wait in a bounded queue per reason, copied
+ * to frame slots allocated with the limiter */
+#define OFP_PIN_QUEUE_LEN 64
+/* Reactor wake-up while packet-ins are queued */
+#define OFP_PIN_DRAIN_MSEC 10
+/* Flows recently sent to the controller, by hash. Their packet-ins
+ * only get the upper half of the bucket, never queue, and leave room
+ * for the flows the controller has not seen yet. */
+#define OFP_PIN_RECENT_SLOTS 256
+#define OFP_PIN_RECENT_MSEC 1000
+
+struct ofp_pin_queued {
+   uint16_t len;
+   uint8_t table_id;
+   uint32_t in_port;
+   uint64_t cookie;
+};
+
+struct ofp_pin_reason {
+   int64_t tokens;
+   long long int last;     /* msec of the last refill */
+   uint16_t head;
+   uint16_t count;
+   struct ofp_pin_queued queue[OFP_PIN_QUEUE_LEN];
+   uint8_t *frames;        /* a frame slot per queue entry */
+   uint64_t n_sent;
+   uint64_t n_queued;
+   uint64_t n_dropped;
+};
+
+struct ofp_pin_limiter {
+   struct ofp_pin_reason reasons[OFP_PIN_N_REASONS];
+   uint32_t recent_hash[OFP_PIN_RECENT_SLOTS];
+   long long int recent_time[OFP_PIN_RECENT_SLOTS];
+   uint8_t *frames;        /* the frame slots of all the reasons */
+};
+
+/* Asynchronous messages, each filtered by the OFPACPT_* slave and
+ * master properties 2 * event and 2 * event + 1 */
+enum ofp_async_event {
+   OFP_ASYNC_PACKET_IN = 0,
+   OFP_ASYNC_PORT_STATUS = 1,
+   OFP_ASYNC_FLOW_REMOVED = 2,
+   OFP_ASYNC_ROLE_STATUS = 3,
+   OFP_ASYNC_TABLE_STATUS = 4,
+   OFP_ASYNC_REQUESTFORWARD = 5,
+   OFP_ASYNC_N_EVENTS = 6
+};
+
+/* Controller connections which can get asynchronous messages */
+#define OFP_CTRL_MAX 64
+/* Reasons of an asynchronous message, as bits of the OFPACPT masks */
+#define OFP_ASYNC_MAX_REASONS 32
+
+/* Receive ring buffer. head and tail run freely and are masked on
+ * access, so tail - head is the number of unread bytes. */
+struct ofp_rx_ring {
+   char *data;
+   uint32_t head;     /* start of the first unprocessed message */
+   uint32_t tail;     /* end of the received bytes */
+   char *linear;      /* copy of a message wrapping around the end of
+                       * the ring, allocated on first use */
+};
+
+/* Bounds checked view of one complete message. It points straight
+ * into the receive ring and is only valid until the handler returns. */
+struct ofp_msg_view {
+   char *data;
+   uint16_t length;   /* same as ofp_header.length of the message */
+};
+
+/* Pointer to 'len' bytes at 'offset' within the message, or NULL when
+ * they run past its end. Handlers walking variable length parts (bands,
+ * buckets, properties) go through this instead of trusting inner length
+ * fields. */
+static inline void *
+ofp_msg_view_pull (struct ofp_msg_view *msg, uint32_t offset, uint32_t len)
+{
+   if (offset > msg->length || len > msg->length - offset)
+      return NULL;
+   return msg->data + offset;
+}
+
+/* Encoded messages waiting to be written to the socket. Entries
+ * [head, head + count) are pending, oldest first, so the whole queue
+ * goes out with a single writev(). */
+struct ofp_out_queue {
+   struct iovec iov[OFP_OUT_QUEUE_LEN];
+   void *bufs[OFP_OUT_QUEUE_LEN];  /* buffer owning each iov entry, NULL
+                                    * for bytes borrowed from the caller */
+   uint16_t head;
+   uint16_t count;
+   uint32_t pending_bytes;
+};
+
 struct ofp_conn {
    int sock_fd;
    enum ofp_controller_role role;
    int miss_send_len;
    uint16_t connection_id;
-   /* place holder for asyn config event and mask */
    uint32_t async_config [OFPACPT_MAX];
-   uint32_t async_config_mask [OFPACPT_MAX];
+   uint32_t async_config_mask [OFPACPT_MAX]; /* OFPACPT_* reason masks, as
+                                              * set by OFPT_SET_ASYNC */
    uint64_t generation_id; /* monotonically increasing sequence number
                             * for master election */
+   bool batching;          /* hold messages in out_queue until the 
+                            * batch ends */
+   bool write_blocked;     /* socket is full, wait for EPOLLOUT */
+   bool read_pending;      /* read budget ran out before EAGAIN */
+   bool active;            /* listed in ofp_reactor.active */
+   bool closing;           /* socket failed, close in this cycle */
+   uint32_t reactor_index; /* slot in ofp_reactor.conns */
+   struct ofp_out_queue out_queue;
+   struct ofp_rx_ring rx_ring;
+   struct ofp_pin_limiter pin_limiter;
+   uint32_t ctrl_slot;     /* bit in the registry subscriber maps, or
+                            * OFP_CTRL_MAX if not registered */
+   uint32_t async_wanted [OFP_ASYNC_N_EVENTS]; /* reasons wanted with the
+                                                * current role */
 };
-#endif
 
+/* Entry of the receive dispatch table, indexed by ofp_type */
+struct ofp_msg_handler {
+   const char *name;
+   uint8_t (*handler) (struct ofp_conn *connection, char *buf);
+   uint16_t min_len;    /* smallest valid ofp_header.length */
+   bool any_version;    /* accepted whatever ofp_header.version is */
+   uint64_t n_msgs;     /* messages handed to the handler */
+   uint64_t n_bytes;
+   uint64_t n_errors;   /* messages rejected before the handler */
+   uint64_t cycles;     /* cycles spent in the handler */
+};
+
+/* Max number of events returned by one epoll_wait() */
+#define OFP_REACTOR_MAX_EVENTS 256
+/* Bytes read from one connection per cycle before moving on to the
+ * others, so a busy controller cannot starve the rest. */
+#define OFP_REACTOR_READ_BUDGET (256 * 1024)
+
+/* Which connections get which asynchronous message: one bit per
+ * connection slot for each event and reason, rebuilt when the role or
+ * the async config of a connection changes */
+struct ofp_ctrl_registry {
+   uint64_t used;
+   struct ofp_conn *slots[OFP_CTRL_MAX];
+   uint64_t subscribers[OFP_ASYNC_N_EVENTS][OFP_ASYNC_MAX_REASONS];
+};
+
+/* Edge triggered epoll loop owning all the controller connections */
+struct ofp_reactor {
+   int epoll_fd;
+   bool stop;
+   uint32_t n_conns;
+   uint32_t max_conns;
+   struct ofp_conn **conns;
+   uint32_t n_active;
+   struct ofp_conn **active;  /* connections to serve in this cycle */
+   struct ofp_ctrl_registry registry;
+};
+#endif
@@ -398,6 +398,22 @@ enum ofp_async_config_prop_type {
    OFPACPT_MAX = 14 /* Max no. of entries */
 };
 
+/* Port numbering. Ports are numbered starting from 1. */
+enum ofp_port_no {
+   /* Maximum number of physical and logical switch ports. */
+   OFPP_MAX = 0xffffff00,
+   /* Reserved OpenFlow Port (fake output "ports"). */
+   OFPP_IN_PORT = 0xfffffff8,    /* Send the packet out the input port. */
+   OFPP_TABLE = 0xfffffff9,      /* Submit the packet to the first flow table */
+   OFPP_NORMAL = 0xfffffffa,     /* Forward using non-OpenFlow pipeline. */
+   OFPP_FLOOD = 0xfffffffb,      /* Flood using non-OpenFlow pipeline. */
+   OFPP_ALL = 0xfffffffc,        /* All standard ports except input port. */
+   OFPP_CONTROLLER = 0xfffffffd, /* Send to controller. */
+   OFPP_LOCAL = 0xfffffffe,      /* Local openflow "port". */
+   OFPP_ANY = 0xffffffff         /* Special value used in some requests when
+                                  * no port is specified (i.e. wildcarded). */
+};
+
 /* Special buffer-id to indicate 'no buffer' */
 #define OFP_NO_BUFFER 0xffffffff
 #define ETHHDR_ADDR_LEN  6
@@ -425,6 +441,21 @@ enum ofp_flow_removed_reason {
    OFPRR_EVICTION = 5,     /* Switch eviction to free resources. */
 };
 
+/* Flags to indicate behavior of the physical port. */
+enum ofp_port_config {
+   OFPPC_PORT_DOWN = 1 << 0,    /* Port is administratively down. */
+   OFPPC_NO_RECV = 1 << 2,      /* Drop all packets received by port. */
+   OFPPC_NO_FWD = 1 << 5,       /* Drop packets forwarded to port. */
+   OFPPC_NO_PACKET_IN = 1 << 6, /* Do not send packet-in msgs for port. */
+};
+
+/* Current state of the physical port. */
+enum ofp_port_state {
+   OFPPS_LINK_DOWN = 1 << 0, /* No physical link present. */
+   OFPPS_BLOCKED = 1 << 1,   /* Port is blocked */
+   OFPPS_LIVE = 1 << 2,      /* Live for Fast Failover Group. */
+};
+
 /* What changed about the physical port */
 enum ofp_port_reason {
    OFPPR_ADD = 0,    /* The port was added. */
@@ -792,4 +823,33 @@ enum ofp_meter_band_type {
 };
 
 
+enum ofp_multipart_type {
+  OFPMP_DESC = 0,            /* Description of this OpenFlow switch. */
+  OFPMP_FLOW = 1,            /* Individual flow statistics. */
+  OFPMP_AGGREGATE = 2,       /* Aggregate flow statistics. */
+  OFPMP_TABLE = 3,           /* Flow table statistics. */
+  OFPMP_PORT_STATS = 4,      /* Port statistics. */
+  OFPMP_QUEUE_STATS = 5,     /* Queue statistics for a port. */
+  OFPMP_GROUP = 6,           /* Group counter statistics. */
+  OFPMP_GROUP_DESC = 7,      /* Group description. */
+  OFPMP_GROUP_FEATURES = 8,  /* Group features. */
+  OFPMP_METER = 9,           /* Meter statistics. */
+  OFPMP_METER_CONFIG = 10,   /* Meter configuration. */
+  OFPMP_METER_FEATURES = 11, /* Meter features. */
+  OFPMP_TABLE_FEATURES = 12, /* Table features. */
+  OFPMP_PORT_DESC = 13,      /* Port description. */
+  OFPMP_TABLE_DESC = 14,     /* Table description. */
+  OFPMP_QUEUE_DESC = 15,     /* Queue description. */
+  OFPMP_FLOW_MONITOR = 16,   /* Flow monitors. */
+  OFPMP_EXPERIMENTER = 0xffff /* Experimenter extension. */
+};
+
+enum ofp_multipart_request_flags {
+  OFPMPF_REQ_MORE = 1 << 0 /* More requests to follow. */
+};
+
+enum ofp_multipart_reply_flags {
+  OFPMPF_REPLY_MORE = 1 << 0 /* More replies to follow. */
+};
+
 #endif
@@ -1,10 +1,67 @@
 #ifndef OPENFLOW_MACRO_H 
 #define OPENFLOW_MACRO_H 
-/* Fill code here to check the group table entries based on the 
- * group table implementation */
+/* Lookup in the group_id index of the group table */
 #define IS_GROUP_ALREADY_EXISTS(GRP_ID) \
-  0 
+  (ofp_group_find (ofp_switch.group_table, (GRP_ID)) != NULL)
 
+/* Lookup in the meter_id index of the meter table */
 #define IS_METER_ALREADY_EXISTS(MTR_ID) \
-  0 
+  (ofp_meter_find (ofp_switch.meter_table, (MTR_ID)) != NULL)
+
+/* Meters with a smaller meter_id are found by direct indexing */
+#define OFP_METER_DENSE_MAX 4096
+/* Datapath cores metering packets, each with its own band credits */
+#define OFP_METER_MAX_CORES 32
+#define OFP_METER_MAX_BANDS 16
+/* Bucket depth of the bands of meters without OFPMF_BURST */
+#define OFP_METER_BURST_MSEC 100
+/* A core takes 1/OFP_METER_CHUNKS of a bucket from the shared bucket at
+ * a time, which bounds the tokens parked on the other cores */
+#define OFP_METER_CHUNKS 256
+/* Cycle clock rate assumed until the reactor measured it */
+#define OFP_METER_CYCLES_PER_MSEC 2000000
+/* Longest wait of the reactor while retired meter memory is pending */
+#define OFP_METER_RECLAIM_MSEC 10
+/* buffer_id: slot index in the low bits, slot generation above */
+#define OFP_PKT_BUF_INDEX_BITS 20
+#define OFP_PKT_BUF_INDEX_MASK ((1u << OFP_PKT_BUF_INDEX_BITS) - 1)
+#define OFP_PKT_BUF_GEN_MASK 0xfff
+#define OFP_PKT_BUF_NONE 0xffffffff
+/* Bigger frames are sent whole with OFP_NO_BUFFER */
+#define OFP_PKT_BUF_FRAME_MAX 2048
+/* Buffers the controller did not use are reclaimed after that */
+#define OFP_PKT_BUF_TIMEOUT_MSEC 5000
+
+/* Size of each message of a multipart reply */
+#define OFP_MULTIPART_REPLY_MAX 16384
+
+/* Errors returned by the table code: 0 for success, otherwise the
+ * ofp_error_msg type and code to send back to the controller. */
+#define OFP_ERROR(TYPE, CODE) \
+  ((1u << 31) | ((uint32_t) (TYPE) << 16) | (CODE))
+#define OFP_ERROR_TYPE(ERR) \
+  (((ERR) >> 16) & 0x7fff)
+#define OFP_ERROR_CODE(ERR) \
+  ((ERR) & 0xffff)
+
+/* Max flow entries held by one flow table */
+#define OFP_FLOW_TABLE_MAX_ENTRIES (1 << 20)
+
+/* Microflow cache geometry, OFP_MICROFLOW_SETS must be a power of 2 */
+#define OFP_MICROFLOW_SETS 4096
+#define OFP_MICROFLOW_WAYS 4
+
+/* Hash slots of the select group table, a power of 2. A bucket gets a
+ * share of the slots proportional to its weight. */
+#define OFP_GROUP_SELECT_SLOTS 256
+#define OFP_GROUP_NO_BUCKET 0xffff
+
+/* Ports whose liveness is tracked, and so the ports a group bucket can
+ * watch */
+#define OFP_PORT_LIVE_MAX 4096
+
+/* Resolution of the flow timeouts */
+#define OFP_TIMER_TICK_MSEC 100
+/* Expired flows handled, and flow-removed messages queued, per batch */
+#define OFP_FLOW_EXPIRE_BATCH 256
 #endif
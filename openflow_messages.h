@@ -525,4 +525,48 @@ struct ofp_meter_mod {
 };
 
 
+struct ofp_multipart_request {
+  struct ofp_header header;
+  uint16_t type;   /* One of the OFPMP_* constants. */
+  uint16_t flags;  /* OFPMPF_REQ_* flags. */
+  uint8_t pad[4];
+  uint8_t body[0]; /* Body of the request. 0 or more bytes. */
+};
+
+struct ofp_multipart_reply {
+  struct ofp_header header;
+  uint16_t type;   /* One of the OFPMP_* constants. */
+  uint16_t flags;  /* OFPMPF_REPLY_* flags. */
+  uint8_t pad[4];
+  uint8_t body[0]; /* Body of the reply. 0 or more bytes. */
+};
+
+/* Body of OFPMP_METER and OFPMP_METER_CONFIG requests. */
+struct ofp_meter_multipart_request {
+  uint32_t meter_id; /* Meter instance, or OFPM_ALL. */
+  uint8_t pad[4];    /* Align to 64 bits. */
+};
+
+/* Statistics for each meter band */
+struct ofp_meter_band_stats {
+  uint64_t packet_band_count; /* Number of packets in band. */
+  uint64_t byte_band_count;   /* Number of bytes in band. */
+};
+
+/* Body of reply to OFPMP_METER request. Meter statistics. */
+struct ofp_meter_stats {
+  uint32_t meter_id;        /* Meter instance. */
+  uint16_t len;             /* Length in bytes of this stats. */
+  uint8_t pad[6];
+  uint32_t flow_count;      /* Number of flows bound to meter. */
+  uint64_t packet_in_count; /* Number of packets in input. */
+  uint64_t byte_in_count;   /* Number of bytes in input. */
+  uint32_t duration_sec;    /* Time meter has been alive in seconds. */
+  uint32_t duration_nsec;   /* Time meter has been alive in nanoseconds
+                             * beyond duration_sec. */
+  struct ofp_meter_band_stats band_stats[0]; /* The band_stats length is
+                                              * inferred from the length
+                                              * field. */
+};
+
 #endif
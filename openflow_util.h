@@ -7,6 +7,57 @@ htonl_64(uint64_t n)
     return htonl(1) == 1 ? n : ((uint64_t) htonl(n) << 32) | htonl(n >> 32);
 }
 
+static inline uint64_t 
+ntohl_64(uint64_t n)
+{
+    return htonl_64(n);
+}
+
+/* Hash helpers (murmur3 mixing) used by the flow, group and meter
+ * indexes. */
+static inline uint64_t
+ofp_hash_add64(uint64_t hash, uint64_t data)
+{
+    data *= 0x87c37b91114253d5ULL;
+    data = (data << 31) | (data >> 33);
+    data *= 0x4cf5ad432745937fULL;
+    hash ^= data;
+    hash = (hash << 27) | (hash >> 37);
+    return hash * 5 + 0x52dce729;
+}
+
+static inline uint32_t
+ofp_hash_finish(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (uint32_t) hash;
+}
+
+static inline uint32_t
+ofp_hash_uint32(uint32_t n)
+{
+    return ofp_hash_finish(ofp_hash_add64(0, n));
+}
+
+/* Cheap monotonic cycle counter, used to profile the control path */
+static inline uint64_t
+ofp_cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 /* Ethernet port description property. */
 struct ofp_port_desc_prop_ethernet {
    uint16_t type; /* OFPPDPT_ETHERNET. */
@@ -36,11 +87,74 @@ struct ofp_port {
    struct ofp_port_desc_prop_ethernet properties[0];
 };
 
+/* Size classes of the message buffer pool: OFP_BUF_MIN_SIZE << class,
+ * 64 bytes up to the biggest OpenFlow message. */
+#define OFP_BUF_MIN_SHIFT 6
+#define OFP_BUF_MIN_SIZE (1 << OFP_BUF_MIN_SHIFT)
+#define OFP_BUF_N_CLASSES 11
+/* Bytes kept on the free list of each class, per thread */
+#define OFP_BUF_POOL_MAX_BYTES (256u * 1024)
+
+/* Hidden header in front of every pooled message buffer */
+struct ofp_buf_hdr {
+    struct ofp_buf_hdr *next;   /* Free list link. */
+    uint32_t size_class;        /* OFP_BUF_N_CLASSES if not pooled. */
+    uint32_t refcount;          /* Output queues holding the buffer. */
+};
+
+struct ofp_buf_pool {
+    struct ofp_buf_hdr *free_list[OFP_BUF_N_CLASSES];
+    uint32_t n_free[OFP_BUF_N_CLASSES];
+};
+
 struct list {
     struct list *prev;     /* Previous list element. */
     struct list *next;     /* Next list element. */
 };
 
+/* Struct holding the member pointed to by PTR */
+#define OFP_CONTAINER_OF(PTR, TYPE, MEMBER) \
+    ((TYPE *) ((char *) (PTR) - offsetof(TYPE, MEMBER)))
+
+/* Open addressing index of table entries on a 32-bit id, which is
+ * 'id_offset' bytes into each entry. Kept at most half full, and
+ * without tombstones: removals shift the following entries back. */
+struct ofp_id_index {
+    void **slots;
+    uint32_t mask;         /* slots - 1 */
+    uint32_t n;            /* entries in the index */
+    uint32_t id_offset;
+};
+
+/* Table entries in the order they were added, linked through the
+ * struct list 'node_offset' bytes into each entry */
+struct ofp_entry_list {
+    struct list *first;
+    struct list *last;
+    uint32_t node_offset;
+};
+
+/* Hierarchical timer wheel: OFP_TIMER_WHEEL_LEVELS levels of
+ * 1 << OFP_TIMER_WHEEL_BITS slots, the first level one tick per slot.
+ * Timers further away than the wheel covers sit in the last level and
+ * are rescheduled when that slot comes around. */
+#define OFP_TIMER_WHEEL_BITS 8
+#define OFP_TIMER_WHEEL_SLOTS (1 << OFP_TIMER_WHEEL_BITS)
+#define OFP_TIMER_WHEEL_MASK (OFP_TIMER_WHEEL_SLOTS - 1)
+#define OFP_TIMER_WHEEL_LEVELS 3
+
+struct ofp_timer {
+    struct ofp_timer *next;
+    struct ofp_timer **pprev;   /* NULL if not scheduled */
+    uint64_t expires;           /* tick */
+};
+
+struct ofp_timer_wheel {
+    uint64_t now;               /* last tick run */
+    uint32_t n_timers;
+    struct ofp_timer *slots[OFP_TIMER_WHEEL_LEVELS][OFP_TIMER_WHEEL_SLOTS];
+};
+
 
 #endif
 